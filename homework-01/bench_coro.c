@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libcoro.h"
+
+/**
+ * Microbenchmark of the coroutine context switch backend and the
+ * scheduler. Measures creation + run + deletion of trivial
+ * coroutines, the cost of a single switch between two yielding
+ * coroutines, how the switch cost scales with the number of
+ * alive coroutines, and the memory of idle coroutines on own and
+ * on shared stacks.
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+coro_empty_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+static int
+coro_yield_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+static void
+bench_create(int count)
+{
+	struct coro *c;
+	double start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		coro_new(coro_empty_f, NULL);
+		/* Keep the number of alive coroutines small. */
+		if (i % 64 == 63) {
+			while ((c = coro_sched_wait()) != NULL)
+				coro_delete(c);
+		}
+	}
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double elapsed = bench_now() - start;
+	printf("create+run+delete: %d coroutines, %.1f ns each\n", count,
+	       elapsed * 1e9 / count);
+}
+
+static void
+bench_switch(int count)
+{
+	struct coro *c;
+	long long switches = 0;
+	double start = bench_now();
+	coro_new(coro_yield_f, &count);
+	coro_new(coro_yield_f, &count);
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	double elapsed = bench_now() - start;
+	printf("switch: %lld switches, %.1f ns each\n", switches,
+	       elapsed * 1e9 / switches);
+}
+
+static void
+bench_sched_scaling(int coro_count, int yield_count)
+{
+	struct coro_opts opts = {
+		.stack_size = 16 * 1024,
+		.no_guard_page = true,
+	};
+	struct coro *c;
+	long long switches = 0;
+	double start = bench_now();
+	for (int i = 0; i < coro_count; ++i)
+		coro_new_ex(coro_yield_f, &yield_count, &opts);
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	double elapsed = bench_now() - start;
+	printf("scheduler: %d coroutines, %lld switches, %.1f ns each\n",
+	       coro_count, switches, elapsed * 1e9 / switches);
+}
+
+/** Resident memory of the process in bytes. */
+static size_t
+bench_rss(void)
+{
+	long size, pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%ld %ld", &size, &pages) != 2)
+		pages = 0;
+	fclose(f);
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+struct idle_arg {
+	bool is_stopped;
+	int round_count;
+	size_t rss;
+};
+
+static int __attribute__((noinline))
+bench_deep_work(int seed)
+{
+	volatile char buf[8 * 1024];
+	memset((char *)buf, seed, sizeof(buf));
+	return buf[seed % sizeof(buf)];
+}
+
+static int
+coro_idle_f(void *arg)
+{
+	struct idle_arg *a = arg;
+	/* Use a lot of stack once, then idle on a shallow one. */
+	int res = bench_deep_work(a->round_count);
+	while (! a->is_stopped)
+		coro_yield();
+	return res;
+}
+
+static int
+coro_idle_stopper_f(void *arg)
+{
+	struct idle_arg *a = arg;
+	for (int i = 0; i < a->round_count; ++i)
+		coro_yield();
+	a->rss = bench_rss();
+	a->is_stopped = true;
+	return 0;
+}
+
+static void
+bench_idle_memory(int coro_count, bool is_shared)
+{
+	struct coro_shared_stack *ss = NULL;
+	struct coro_opts opts = {
+		.stack_size = 16 * 1024,
+		.no_guard_page = true,
+	};
+	if (is_shared) {
+		ss = coro_shared_stack_new(64 * 1024);
+		opts.shared_stack = ss;
+	}
+	struct idle_arg a = {.is_stopped = false, .round_count = 10};
+	size_t rss = bench_rss();
+	struct coro *c;
+	long long switches = 0;
+	double start = bench_now();
+	for (int i = 0; i < coro_count; ++i)
+		coro_new_ex(coro_idle_f, &a, &opts);
+	coro_new(coro_idle_stopper_f, &a);
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	double elapsed = bench_now() - start;
+	if (ss != NULL)
+		coro_shared_stack_delete(ss);
+	printf("idle %s stacks: %d coroutines, %.1f bytes each, "
+	       "%.1f ns per switch\n", is_shared ? "shared" : "own",
+	       coro_count, ((double)a.rss - rss) / coro_count,
+	       elapsed * 1e9 / switches);
+}
+
+int
+main(int argc, char **argv)
+{
+	(void)argc;
+	printf("%s\n", argv[0]);
+	coro_sched_init();
+	bench_create(100000);
+	bench_switch(1000000);
+	bench_sched_scaling(1000, 100);
+	bench_sched_scaling(10000, 100);
+	bench_sched_scaling(100000, 100);
+	bench_idle_memory(100000, false);
+	bench_idle_memory(100000, true);
+	return 0;
+}
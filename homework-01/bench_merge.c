@@ -0,0 +1,120 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "merge.h"
+
+/**
+ * Benchmark of the k-way merge of sorted runs in memory: the
+ * loser tree against a scan of all the runs per number, for k from
+ * 2 to 1024.
+ */
+
+#define TOTAL_COUNT (1 << 22)
+#define BATCH_SIZE 4096
+// The scan takes too long on more runs.
+#define SCAN_MAX_RUNS 256
+
+static double get_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int **make_runs(int k, size_t run_size) {
+  int **runs = malloc(sizeof(int *) * k);
+  for (int i = 0; i < k; ++i) {
+    runs[i] = malloc(sizeof(int) * run_size);
+    // Random increments, so the runs interleave.
+    int value = INT_MIN + rand() % 1000;
+    for (size_t j = 0; j < run_size; ++j) {
+      value += rand() % (2 * k);
+      runs[i][j] = value;
+    }
+  }
+  return runs;
+}
+
+static double bench_tree(int **runs, int k, size_t run_size, long long *checksum) {
+  struct merge_source *sources = malloc(sizeof(struct merge_source) * k);
+  for (int i = 0; i < k; ++i) {
+    sources[i].pos = runs[i];
+    sources[i].end = runs[i] + run_size;
+    sources[i].refill = NULL;
+    sources[i].ctx = NULL;
+  }
+  int *out = malloc(sizeof(int) * BATCH_SIZE);
+  double start = get_now();
+  struct merge_tree tree;
+  merge_tree_create(&tree, sources, k);
+  size_t count;
+  int prev = INT_MIN;
+  while ((count = merge_tree_pop(&tree, out, BATCH_SIZE)) > 0) {
+    for (size_t i = 0; i < count; ++i) {
+      if (out[i] < prev) {
+        printf("Merge tree output is not sorted\n");
+        exit(-1);
+      }
+      prev = out[i];
+      *checksum += out[i];
+    }
+  }
+  merge_tree_destroy(&tree);
+  double elapsed = get_now() - start;
+  free(out);
+  free(sources);
+  return elapsed;
+}
+
+static double bench_scan(int **runs, int k, size_t run_size, long long *checksum) {
+  size_t *indices = calloc(k, sizeof(size_t));
+  double start = get_now();
+  while (true) {
+    int min_value = INT_MAX;
+    int min_idx = -1;
+    for (int i = 0; i < k; ++i) {
+      if (indices[i] < run_size && runs[i][indices[i]] < min_value) {
+        min_value = runs[i][indices[i]];
+        min_idx = i;
+      }
+    }
+    if (min_idx == -1) {
+      break;
+    }
+    ++indices[min_idx];
+    *checksum += min_value;
+  }
+  double elapsed = get_now() - start;
+  free(indices);
+  return elapsed;
+}
+
+int main(void) {
+  srand(1);
+  printf("merge of %d numbers, ns per number\n", TOTAL_COUNT);
+  printf("%6s %10s %10s\n", "runs", "tree", "scan");
+  for (int k = 2; k <= 1024; k *= 2) {
+    size_t run_size = TOTAL_COUNT / k;
+    int **runs = make_runs(k, run_size);
+    size_t total = run_size * k;
+    long long tree_sum = 0;
+    double tree_time = bench_tree(runs, k, run_size, &tree_sum);
+    printf("%6d %10.1f", k, tree_time * 1e9 / total);
+    if (k <= SCAN_MAX_RUNS) {
+      long long scan_sum = 0;
+      double scan_time = bench_scan(runs, k, run_size, &scan_sum);
+      if (scan_sum != tree_sum) {
+        printf("\nMerge tree output differs from the scan\n");
+        return -1;
+      }
+      printf(" %10.1f\n", scan_time * 1e9 / total);
+    } else {
+      printf(" %10s\n", "-");
+    }
+    for (int i = 0; i < k; ++i) {
+      free(runs[i]);
+    }
+    free(runs);
+  }
+  return 0;
+}
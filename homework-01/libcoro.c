@@ -1,76 +1,810 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include "libcoro.h"
 
+/** Signal of the preemption timers, like in Go. Ignored by default. */
+#define CORO_PREEMPT_SIGNAL SIGURG
+
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+/*
+ * Coroutine I/O is submitted to io_uring when it is available, or
+ * to a few offload threads otherwise. Build with -DCORO_IO_NO_URING
+ * to always use the threads.
+ */
+#if defined(__linux__) && ! defined(CORO_IO_NO_URING) && \
+    __has_include(<linux/io_uring.h>)
+#define CORO_IO_URING 1
+#include <linux/io_uring.h>
+#else
+#define CORO_IO_URING 0
+#endif
+
+/*
+ * Context switch backend. By default the coroutines are switched by
+ * a few lines of assembly which save only callee-saved registers and
+ * do no syscalls. On other platforms, or when built with
+ * -DCORO_CTX_SIGNAL, the portable sigaltstack + sigsetjmp trick is
+ * used.
+ */
+#if !defined(CORO_CTX_SIGNAL) && defined(__ELF__) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_CTX_ASM 1
+#else
+#define CORO_CTX_ASM 0
+#endif
+
+/** Machine context of a suspended coroutine. */
+struct coro_ctx {
+#if CORO_CTX_ASM
+	/**
+	 * Stack pointer. Callee-saved registers and the resume
+	 * address are stored right on the stack.
+	 */
+	void *sp;
+#else
+	sigjmp_buf buf;
+#endif
+};
+
+/**
+ * Coroutine stack, mapped with mmap. The lowest page is a PROT_NONE
+ * guard, so an overflow crashes instead of corrupting the memory.
+ * The pages are committed by the kernel only when touched. Usable
+ * size is a power of 2 pages. The descriptor of a used stack is
+ * stored in its coroutine. Descriptor of a cached stack is stored
+ * at the top of the stack itself.
+ */
+struct coro_stack {
+	/** Start of the mapping. The guard page is there. */
+	char *map;
+	/** Size of the mapping including the guard page. */
+	size_t map_size;
+	/**
+	 * False, if the stack is mapped without the guard page. Then
+	 * the stacks don't split the process memory map into a pair
+	 * of areas each, which is limited by vm.max_map_count.
+	 */
+	bool has_guard;
+	/** Links in the pool's list of used or cached stacks. */
+	struct coro_stack *next, *prev;
+};
+
+struct coro;
+
+/**
+ * Called in the new context after a coroutine has parked and
+ * switched away. Here it can be safely handed to somebody, who
+ * will wake it up.
+ */
+typedef void (*coro_park_f)(struct coro *c, void *arg);
+
+/** A coroutine, parked in a synchronization primitive. */
+struct coro_waiter {
+	struct coro *coro;
+	/** Message to send or the received one in a channel. */
+	void *msg;
+	/** False, if woken up because the channel was closed. */
+	bool is_ok;
+	struct coro_waiter *next;
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
 	/** Stack, used by the coroutine. */
-	void *stack;
+	struct coro_stack stack;
+	/**
+	 * True, if the stack was painted with a pattern on creation
+	 * to measure its usage.
+	 */
+	bool is_stack_painted;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
 	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
+	struct coro_ctx ctx;
 	/** True, if the coroutine has finished. */
 	bool is_finished;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
+	/** Not NULL, if the coroutine is being parked. */
+	coro_park_f park_cb;
+	void *park_arg;
+	/** Not NULL, if the telemetry is collected. */
+	struct coro_telemetry *telemetry;
+	/** When the coroutine became ready to run, in nanoseconds. */
+	unsigned long long ready_time;
+	/** When the coroutine was switched in, in nanoseconds. */
+	unsigned long long run_time;
+	/** Scheduling policy, never CORO_SCHED_DEFAULT. */
+	enum coro_sched_policy policy;
+	int priority;
+	unsigned weight;
+	/**
+	 * Runtime in nanoseconds, scaled by CORO_WEIGHT_DEFAULT /
+	 * weight. Fair-share coroutines with the least one run first.
+	 */
+	unsigned long long vruntime;
+	/** Since when the runtime is not accounted yet. */
+	unsigned long long vruntime_start;
+	/** Scheduler, running the coroutine. */
+	struct coro_scheduler *scheduler;
+	/**
+	 * Not NULL, if the coroutine runs on a shared stack. Then
+	 * 'stack' is not used, and the live part of the coroutine's
+	 * stack is kept in 'saved', while another coroutine owns the
+	 * shared stack.
+	 */
+	struct coro_shared_stack *shared_stack;
+	char *saved;
+	size_t saved_size;
+	size_t saved_capacity;
+	/**
+	 * The coroutine in a wait queue. It is not on the stack,
+	 * which can be swapped out while the coroutine waits.
+	 */
+	struct coro_waiter waiter;
+	/**
+	 * True, if the coroutine is taken by coro_join() instead of
+	 * the finished queue.
+	 */
+	bool is_joined;
+	/**
+	 * Created with 'joinable' option, never enters the finished
+	 * queue.
+	 */
+	bool is_joinable;
+	/**
+	 * True, if the finished coroutine has left its stack and is
+	 * handed to coro_join() or to the finished queue.
+	 */
+	bool is_done;
+	/** Coroutine, parked in coro_join() of this one. */
+	struct coro *joiner;
+	/**
+	 * Links in a scheduler queue. A coroutine is either
+	 * running, or ready to run, or parked, or finished.
+	 */
 	struct coro *next, *prev;
 };
 
+/** Execution stack of a group of coroutines. */
+struct coro_shared_stack {
+	struct coro_stack stack;
+	/** Coroutine, whose live stack is on the shared one now. */
+	struct coro *owner;
+};
+
+/** Intrusive FIFO queue of coroutines. */
+struct coro_queue {
+	struct coro *first, *last;
+};
+
+/** Number of priorities of CORO_SCHED_PRIO coroutines. */
+enum { CORO_PRIO_COUNT = CORO_PRIO_MAX + 1 };
+
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * Coroutines ready to run, by policies. The best one is picked in
+ * O(1) for the priority and round-robin ones, O(log n) for the
+ * fair ones.
  */
-static struct coro coro_sched;
+struct coro_runq {
+	/** Priority coroutines, a FIFO per priority. */
+	struct coro_queue prio[CORO_PRIO_COUNT];
+	/** Bit per non-empty priority queue. */
+	uint32_t prio_mask;
+	struct coro_queue rr;
+	/** Min-heap of the fair-share coroutines by vruntime. */
+	struct coro **fair;
+	size_t fair_count;
+	size_t fair_capacity;
+	/**
+	 * Vruntime of the last picked fair-share coroutine. The
+	 * ones waking up after a long sleep start with it, so as
+	 * not to monopolize the worker.
+	 */
+	unsigned long long min_vruntime;
+};
+
+/** A thread, running coroutines. */
+struct coro_worker {
+	/**
+	 * Main coroutine of the thread. In the single-threaded mode
+	 * it is the scheduler - it catches and returns dead ones to
+	 * a user. In M:N mode it is the worker loop.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment. */
+	struct coro *this_ptr;
+	/**
+	 * Coroutine, which has just switched away and needs to be
+	 * put into a queue. It can't be done before the switch,
+	 * because then another worker could steal and resume it
+	 * before its context is saved.
+	 */
+	struct coro *switched_from;
+	/** Coroutines ready to run on this worker. */
+	struct coro_runq ready;
+	/** Protects the ready queue from thieves in M:N mode. */
+	pthread_mutex_t mutex;
+	pthread_t thread;
+	/** Preemption timer of the thread. */
+	timer_t preempt_timer;
+	/** Interval of the timer in microseconds, 0 if not armed. */
+	long long preempt_quantum;
+	/** When the last switch has started, for the telemetry. */
+	unsigned long long switch_time;
+	/**
+	 * coro_preempt_requested of the worker's thread, to request
+	 * preemption of the running coroutine from other threads.
+	 */
+	volatile sig_atomic_t *preempt_flag;
+	/** coro_preempt_key() of the running coroutine. */
+	int running_key;
+	struct coro_scheduler *scheduler;
+	/**
+	 * Context on its own small stack, which copies a shared
+	 * stack when a coroutine switches to another one on the
+	 * same stack. Created on demand.
+	 */
+	struct coro_ctx copier_ctx;
+	struct coro_stack copier_stack;
+	bool has_copier;
+	/** Coroutine to switch to via the copier. */
+	struct coro *copy_to;
+};
+
+/** Coroutine scheduler. */
+struct coro_scheduler {
+	/**
+	 * Worker threads. In the single-threaded mode it is only the
+	 * thread which called coro_sched_init().
+	 */
+	struct coro_worker *workers;
+	int worker_count;
+	/** True, if the coroutines are run by worker threads. */
+	bool is_mt;
+	/**
+	 * True, if in that moment the scheduler is waiting for a
+	 * coroutine finish. Used in the single-threaded mode.
+	 */
+	bool is_waiting;
+	/** Finished coroutines, not yet returned to the user. */
+	struct coro_queue finished;
+	/**
+	 * Coroutines woken up by other threads in the single-threaded
+	 * mode. They are moved to the ready queue by the scheduler's
+	 * thread.
+	 */
+	struct coro_queue remote;
+	/** True, if the remote queue is not empty. */
+	bool has_remote;
+	/** Number of coroutines not yet returned by coro_sched_wait(). */
+	long long coro_count;
+	/** Number of workers sleeping without work. */
+	int idle_count;
+	/** Worker to give the next coroutine created outside of them. */
+	int next_worker;
+	/** True, if the workers should exit. */
+	bool is_stopping;
+	/** Preemption timer interval for the workers, 0 - disabled. */
+	long long preempt_quantum;
+	/** True, if new coroutines collect the telemetry. */
+	bool has_telemetry;
+	/** Policy of new coroutines by default. */
+	enum coro_sched_policy policy;
+	/** Number of coro_wakeup() calls in progress in other threads. */
+	int foreign_wakeup_count;
+	/** Protects the fields above in M:N mode. */
+	pthread_mutex_t mutex;
+	/** Signaled when a coroutine has finished. */
+	pthread_cond_t finished_cond;
+	/**
+	 * Signaled when a coroutine is ready to run and there can
+	 * be sleeping workers.
+	 */
+	pthread_cond_t work_cond;
+};
+
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * Scheduler of the current thread, used by coro_new() and
+ * coro_sched_*(). Worker threads have their own scheduler current.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+static __thread struct coro_scheduler *coro_sched_ptr = NULL;
+/** Worker of the current thread. NULL if it is not a worker. */
+static __thread struct coro_worker *coro_worker_ptr = NULL;
+#if ! CORO_CTX_ASM
 /**
  * Buffer, used by the coroutine constructor to escape from the
  * signal handler back into the constructor to rollback
  * sigaltstack etc.
  */
-static sigjmp_buf start_point;
+static __thread sigjmp_buf start_point;
+/** Coroutine being created by coro_ctx_create(). */
+static __thread struct coro *coro_ctx_new_ptr = NULL;
+/**
+ * The signal handler is process-wide, so the coroutines are
+ * created one at a time.
+ */
+static pthread_mutex_t coro_ctx_create_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * Set by the preemption timer of the current thread, reset on each
+ * switch.
+ */
+static __thread volatile sig_atomic_t coro_preempt_requested = 0;
+
+/**
+ * Worker of the current thread. Coroutines can move between the
+ * threads in M:N mode, so the thread-local variable address must be
+ * reloaded after each switch. The compiler is free to cache it, but
+ * not a result of this function.
+ */
+static __attribute__((noinline)) struct coro_worker *
+coro_worker_this(void)
+{
+	struct coro_worker *w = coro_worker_ptr;
+	__asm__ volatile("" : "+r"(w));
+	return w;
+}
+
+/**
+ * Not inlined for the same reason as coro_worker_this(): the flag
+ * address of the thread, where the caller was before a switch, must
+ * not be reused.
+ */
+__attribute__((noinline)) bool
+coro_preempt_is_requested(void)
+{
+	volatile sig_atomic_t *flag = &coro_preempt_requested;
+	__asm__ volatile("" : "+r"(flag));
+	return *flag != 0;
+}
+
+/**
+ * Scheduler of the current coroutine, or of the current thread
+ * outside of the coroutines.
+ */
+static struct coro_scheduler *
+coro_sched_this(void)
+{
+	struct coro_worker *w = coro_worker_this();
+	return w != NULL ? w->scheduler : coro_sched_ptr;
+}
+
+enum {
+	/** Size of a coroutine stack by default. */
+	CORO_STACK_SIZE = 1024 * 1024,
+	/**
+	 * How many free stacks the pool keeps. The rest are
+	 * unmapped.
+	 */
+	CORO_STACK_POOL_MAX_CACHED = 256,
+	/** Stacks are cached in classes by log2 of page count. */
+	CORO_STACK_CLASS_COUNT = 32,
+	/** Stack of a worker's shared stack copier. */
+	CORO_COPIER_STACK_SIZE = 16 * 1024,
+};
+
+/** A word, which the painted stacks are filled with. */
+static const uint64_t CORO_STACK_PAINT = 0xdeadc0dedeadc0deULL;
+
+/**
+ * Pool of coroutine stacks. Stacks of deleted coroutines are cached
+ * and given to new ones, so as not to pay for mmap, munmap and page
+ * faults each time.
+ */
+static struct {
+	/** Stacks owned by the coroutines. */
+	struct coro_stack *used;
+	/**
+	 * Free stacks, ready for reuse, by presence of the guard
+	 * and size classes.
+	 */
+	struct coro_stack *cached[2][CORO_STACK_CLASS_COUNT];
+	size_t used_count;
+	size_t cached_count;
+	size_t used_peak;
+	/** Maximal total resident size among the stats calls. */
+	size_t resident_sampled_peak;
+	/** Coroutines are created and deleted in any thread. */
+	pthread_mutex_t mutex;
+} coro_stack_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void
+coro_stack_list_add(struct coro_stack **list, struct coro_stack *s)
+{
+	s->next = *list;
+	s->prev = NULL;
+	if (*list != NULL)
+		(*list)->prev = s;
+	*list = s;
+}
+
+static void
+coro_stack_list_delete(struct coro_stack **list, struct coro_stack *s)
+{
+	if (s->prev != NULL)
+		s->prev->next = s->next;
+	else
+		*list = s->next;
+	if (s->next != NULL)
+		s->next->prev = s->prev;
+}
+
+static size_t
+coro_page_size(void)
+{
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+/** Lowest usable address of the stack. */
+static inline void *
+coro_stack_bottom(const struct coro_stack *s)
+{
+	return s->map + s->has_guard * coro_page_size();
+}
+
+/** Usable size of the stack. */
+static inline size_t
+coro_stack_size(const struct coro_stack *s)
+{
+	return s->map_size - s->has_guard * coro_page_size();
+}
+
+/** Where a cached stack keeps its descriptor. */
+static inline struct coro_stack *
+coro_stack_cached_desc(const struct coro_stack *s)
+{
+	uintptr_t top = (uintptr_t)(s->map + s->map_size - sizeof(*s));
+	return (struct coro_stack *)(top & ~(uintptr_t)15);
+}
+
+/** Size class of a stack with the given usable page count. */
+static int
+coro_stack_class(size_t page_count)
+{
+	int cls = 0;
+	while (((size_t)1 << cls) < page_count)
+		++cls;
+	return cls;
+}
+
+/**
+ * Take a stack of at least @a size bytes from the pool, or map a
+ * new one. The descriptor is filled into @a s.
+ */
+static void
+coro_stack_new(struct coro_stack *s, size_t size, bool has_guard)
+{
+	size_t page_size = coro_page_size();
+	int cls = coro_stack_class((size + page_size - 1) / page_size);
+	if (cls >= CORO_STACK_CLASS_COUNT) {
+		errno = ENOMEM;
+		handle_error();
+	}
+	pthread_mutex_lock(&coro_stack_pool.mutex);
+	struct coro_stack **cached_list =
+		&coro_stack_pool.cached[has_guard][cls];
+	struct coro_stack *cached = *cached_list;
+	if (cached != NULL) {
+		coro_stack_list_delete(cached_list, cached);
+		--coro_stack_pool.cached_count;
+		*s = *cached;
+	} else {
+		pthread_mutex_unlock(&coro_stack_pool.mutex);
+		size_t map_size = (((size_t)1 << cls) + has_guard) * page_size;
+		char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				 -1, 0);
+		if (map == MAP_FAILED)
+			handle_error();
+		if (has_guard && mprotect(map, page_size, PROT_NONE) != 0)
+			handle_error();
+		s->map = map;
+		s->map_size = map_size;
+		s->has_guard = has_guard;
+		pthread_mutex_lock(&coro_stack_pool.mutex);
+	}
+	coro_stack_list_add(&coro_stack_pool.used, s);
+	if (++coro_stack_pool.used_count > coro_stack_pool.used_peak)
+		coro_stack_pool.used_peak = coro_stack_pool.used_count;
+	pthread_mutex_unlock(&coro_stack_pool.mutex);
+}
+
+/** Return a stack into the pool. */
+static void
+coro_stack_delete(struct coro_stack *s)
+{
+	pthread_mutex_lock(&coro_stack_pool.mutex);
+	coro_stack_list_delete(&coro_stack_pool.used, s);
+	--coro_stack_pool.used_count;
+	if (coro_stack_pool.cached_count >= CORO_STACK_POOL_MAX_CACHED) {
+		pthread_mutex_unlock(&coro_stack_pool.mutex);
+		if (munmap(s->map, s->map_size) != 0)
+			handle_error();
+		return;
+	}
+	struct coro_stack *cached = coro_stack_cached_desc(s);
+	*cached = *s;
+	int cls = coro_stack_class(coro_stack_size(s) / coro_page_size());
+	coro_stack_list_add(&coro_stack_pool.cached[s->has_guard][cls],
+			    cached);
+	++coro_stack_pool.cached_count;
+	pthread_mutex_unlock(&coro_stack_pool.mutex);
+}
 
-/** Add a new coroutine to the beginning of the list. */
+/** Fill the stack with a pattern to be able to find its peak usage. */
 static void
-coro_list_add(struct coro *c)
+coro_stack_paint(struct coro_stack *s)
+{
+	uint64_t *begin = coro_stack_bottom(s);
+	uint64_t *end = begin + coro_stack_size(s) / sizeof(*begin);
+	for (uint64_t *word = begin; word < end; ++word)
+		*word = CORO_STACK_PAINT;
+}
+
+/**
+ * Find the lowest overwritten word of a painted stack. Everything
+ * above it has been used.
+ */
+static size_t
+coro_stack_painted_used(const struct coro_stack *s)
+{
+	const uint64_t *begin = coro_stack_bottom(s);
+	const uint64_t *end = begin + coro_stack_size(s) / sizeof(*begin);
+	const uint64_t *word = begin;
+	while (word < end && *word == CORO_STACK_PAINT)
+		++word;
+	return (end - word) * sizeof(*word);
+}
+
+/** How many bytes of the stack are backed by RAM now. */
+static size_t
+coro_stack_resident(const struct coro_stack *s)
+{
+	size_t page_size = coro_page_size();
+	char *begin = coro_stack_bottom(s);
+	char *end = s->map + s->map_size;
+	size_t resident = 0;
+	unsigned char vec[256];
+	while (begin < end) {
+		size_t size = end - begin;
+		if (size > sizeof(vec) * page_size)
+			size = sizeof(vec) * page_size;
+		if (mincore(begin, size, vec) != 0)
+			handle_error();
+		size_t page_count = size / page_size;
+		for (size_t i = 0; i < page_count; ++i)
+			resident += (vec[i] & 1) * page_size;
+		begin += size;
+	}
+	return resident;
+}
+
+void
+coro_stack_pool_stats(struct coro_stack_pool_stats *stats)
+{
+	size_t resident = 0;
+	pthread_mutex_lock(&coro_stack_pool.mutex);
+	for (struct coro_stack *s = coro_stack_pool.used; s != NULL;
+	     s = s->next)
+		resident += coro_stack_resident(s);
+	for (int g = 0; g < 2; ++g) {
+		for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+			struct coro_stack *s = coro_stack_pool.cached[g][i];
+			for (; s != NULL; s = s->next)
+				resident += coro_stack_resident(s);
+		}
+	}
+	if (resident > coro_stack_pool.resident_sampled_peak)
+		coro_stack_pool.resident_sampled_peak = resident;
+	stats->used = coro_stack_pool.used_count;
+	stats->used_peak = coro_stack_pool.used_peak;
+	stats->cached = coro_stack_pool.cached_count;
+	stats->resident = resident;
+	stats->resident_sampled_peak =
+		coro_stack_pool.resident_sampled_peak;
+	pthread_mutex_unlock(&coro_stack_pool.mutex);
+}
+
+static inline bool
+coro_queue_is_empty(const struct coro_queue *q)
+{
+	return q->first == NULL;
+}
+
+static inline void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->next = NULL;
+	c->prev = q->last;
+	if (q->last != NULL)
+		q->last->next = c;
+	else
+		q->first = c;
+	q->last = c;
+}
+
+static inline struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->first;
+	if (c == NULL)
+		return NULL;
+	q->first = c->next;
+	if (q->first != NULL)
+		q->first->prev = NULL;
+	else
+		q->last = NULL;
+	return c;
+}
+
+static inline void
+coro_queue_remove(struct coro_queue *q, struct coro *c)
+{
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		q->first = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	else
+		q->last = c->prev;
+}
+
+/** Rank of the policy. Lower ranks are picked first. */
+static inline int
+coro_policy_rank(enum coro_sched_policy policy)
+{
+	switch (policy) {
+	case CORO_SCHED_PRIO:
+		return 0;
+	case CORO_SCHED_RR:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+/**
+ * True, if @a a should run before @a b. Equals run in turns, so
+ * a coroutine yields to the equal ones.
+ */
+static inline bool
+coro_runs_before(const struct coro *a, const struct coro *b)
+{
+	int rank_a = coro_policy_rank(a->policy);
+	int rank_b = coro_policy_rank(b->policy);
+	if (rank_a != rank_b)
+		return rank_a < rank_b;
+	if (a->policy == CORO_SCHED_PRIO)
+		return a->priority > b->priority;
+	if (a->policy == CORO_SCHED_FAIR)
+		return a->vruntime < b->vruntime;
+	return false;
+}
+
+/**
+ * Urgency of the coroutine for the preemption requests, lower is
+ * more urgent. Only the priorities preempt, the fair share is
+ * kept by the switches.
+ */
+static inline int
+coro_preempt_key(const struct coro *c)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	if (c->policy == CORO_SCHED_PRIO)
+		return CORO_PRIO_MAX - c->priority;
+	return CORO_PRIO_COUNT;
+}
+
+static inline void
+coro_runq_swap(struct coro **heap, size_t i, size_t j)
+{
+	struct coro *tmp = heap[i];
+	heap[i] = heap[j];
+	heap[j] = tmp;
 }
 
-/** Remove a coroutine from the list. */
 static void
-coro_list_delete(struct coro *c)
+coro_runq_push(struct coro_runq *q, struct coro *c)
+{
+	if (c->policy == CORO_SCHED_PRIO) {
+		coro_queue_push(&q->prio[c->priority], c);
+		q->prio_mask |= 1U << c->priority;
+		return;
+	}
+	if (c->policy == CORO_SCHED_RR) {
+		coro_queue_push(&q->rr, c);
+		return;
+	}
+	if (c->vruntime < q->min_vruntime)
+		c->vruntime = q->min_vruntime;
+	if (q->fair_count == q->fair_capacity) {
+		q->fair_capacity = q->fair_capacity == 0 ?
+				   16 : q->fair_capacity * 2;
+		q->fair = realloc(q->fair,
+				  sizeof(*q->fair) * q->fair_capacity);
+	}
+	size_t i = q->fair_count++;
+	q->fair[i] = c;
+	while (i > 0 && q->fair[i]->vruntime <
+			q->fair[(i - 1) / 2]->vruntime) {
+		coro_runq_swap(q->fair, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static inline struct coro *
+coro_runq_peek(const struct coro_runq *q)
+{
+	if (q->prio_mask != 0)
+		return q->prio[31 - __builtin_clz(q->prio_mask)].first;
+	if (q->rr.first != NULL)
+		return q->rr.first;
+	return q->fair_count > 0 ? q->fair[0] : NULL;
+}
+
+/**
+ * Take the best coroutine, if it should run before @a from. Any
+ * coroutine, if @a from is NULL.
+ */
+static struct coro *
+coro_runq_pop(struct coro_runq *q, const struct coro *from)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	struct coro *c = coro_runq_peek(q);
+	if (c == NULL || (from != NULL && coro_runs_before(from, c)))
+		return NULL;
+	if (c->policy == CORO_SCHED_PRIO) {
+		struct coro_queue *pq = &q->prio[c->priority];
+		coro_queue_pop(pq);
+		if (coro_queue_is_empty(pq))
+			q->prio_mask &= ~(1U << c->priority);
+		return c;
+	}
+	if (c->policy == CORO_SCHED_RR)
+		return coro_queue_pop(&q->rr);
+	q->min_vruntime = c->vruntime;
+	q->fair[0] = q->fair[--q->fair_count];
+	size_t i = 0;
+	while (true) {
+		size_t min = i;
+		size_t left = 2 * i + 1;
+		size_t right = left + 1;
+		if (left < q->fair_count &&
+		    q->fair[left]->vruntime < q->fair[min]->vruntime)
+			min = left;
+		if (right < q->fair_count &&
+		    q->fair[right]->vruntime < q->fair[min]->vruntime)
+			min = right;
+		if (min == i)
+			break;
+		coro_runq_swap(q->fair, i, min);
+		i = min;
+	}
+	return c;
 }
 
 int
@@ -85,6 +819,14 @@ coro_switch_count(const struct coro *c)
 	return c->switch_count;
 }
 
+size_t
+coro_stack_used(const struct coro *c)
+{
+	if (! c->is_stack_painted)
+		return 0;
+	return coro_stack_painted_used(&c->stack);
+}
+
 bool
 coro_is_finished(const struct coro *c)
 {
@@ -94,114 +836,1159 @@ coro_is_finished(const struct coro *c)
 void
 coro_delete(struct coro *c)
 {
-	free(c->stack);
+	if (c->shared_stack == NULL)
+		coro_stack_delete(&c->stack);
+	else if (c->shared_stack->owner == c)
+		c->shared_stack->owner = NULL;
+	free(c->saved);
+	free(c->telemetry);
 	free(c);
 }
 
-/** Switch the current coroutine to an arbitrary one. */
-static void
-coro_yield_to(struct coro *to)
+struct coro_shared_stack *
+coro_shared_stack_new(size_t size)
 {
-	struct coro *from = coro_this_ptr;
-	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	struct coro_shared_stack *ss = malloc(sizeof(*ss));
+	coro_stack_new(&ss->stack, size != 0 ? size : CORO_STACK_SIZE, true);
+	ss->owner = NULL;
+	return ss;
 }
 
 void
-coro_yield(void)
+coro_shared_stack_delete(struct coro_shared_stack *ss)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
-	if (to == NULL)
-		coro_yield_to(&coro_sched);
-	else
-		coro_yield_to(to);
+	coro_stack_delete(&ss->stack);
+	free(ss);
 }
 
-void
-coro_sched_init(void)
+/** Sub-buckets of each power of 2 in a histogram, log2. */
+enum { CORO_HIST_SUB_BITS = 2 };
+
+static inline unsigned long long
+coro_now_ns(void)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-struct coro *
-coro_sched_wait(void)
+static inline int
+coro_hist_bucket(unsigned long long value)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
-		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
+	const int sub_count = 1 << CORO_HIST_SUB_BITS;
+	if (value < (unsigned long long)sub_count)
+		return value;
+	int e = 63 - __builtin_clzll(value);
+	int sub = (value >> (e - CORO_HIST_SUB_BITS)) & (sub_count - 1);
+	return (e - CORO_HIST_SUB_BITS + 1) * sub_count + sub;
+}
+
+/** The smallest value, falling into the bucket. */
+static unsigned long long
+coro_hist_bucket_min(int i)
+{
+	const int sub_count = 1 << CORO_HIST_SUB_BITS;
+	if (i < sub_count)
+		return i;
+	int e = i / sub_count + CORO_HIST_SUB_BITS - 1;
+	unsigned long long sub = sub_count + i % sub_count;
+	return sub << (e - CORO_HIST_SUB_BITS);
+}
+
+static inline void
+coro_hist_add(struct coro_hist *h, unsigned long long value)
+{
+	++h->count;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+	++h->buckets[coro_hist_bucket(value)];
+}
+
+unsigned long long
+coro_hist_percentile(const struct coro_hist *h, double p)
+{
+	if (h->count == 0)
+		return 0;
+	unsigned long long rank = p * h->count;
+	if (rank >= h->count)
+		rank = h->count - 1;
+	unsigned long long seen = 0;
+	for (int i = 0; i < CORO_HIST_BUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen <= rank)
+			continue;
+		/* The upper bound of the bucket, but not above max. */
+		unsigned long long v = i + 1 < CORO_HIST_BUCKETS ?
+				       coro_hist_bucket_min(i + 1) - 1 : h->max;
+		return v < h->max ? v : h->max;
 	}
-	return NULL;
+	return h->max;
 }
 
-struct coro *
-coro_this(void)
+bool
+coro_telemetry(const struct coro *c, struct coro_telemetry *t)
 {
-	return coro_this_ptr;
+	if (c->telemetry == NULL)
+		return false;
+	memcpy(t, c->telemetry, sizeof(*t));
+	return true;
 }
 
-/**
- * The core part of the coroutines creation - this signal handler
- * is run on a separate stack using sigaltstack. On an invokation
- * it remembers its current context and jumps back to the
- * coroutine constructor. Later the coroutine continues from here.
- */
 static void
-coro_body(int signum)
+coro_hist_dump(const struct coro_hist *h, FILE *out)
 {
-	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
-	/*
-	 * On an invokation jump back to the constructor right
-	 * after remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finaly start work.
-	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
+	fprintf(out, "{\"count\": %llu, \"sum\": %llu, \"p50\": %llu, "
+		"\"p99\": %llu, \"max\": %llu, \"buckets\": [", h->count,
+		h->sum, coro_hist_percentile(h, 0.5),
+		coro_hist_percentile(h, 0.99), h->max);
+	const char *sep = "";
+	for (int i = 0; i < CORO_HIST_BUCKETS; ++i) {
+		if (h->buckets[i] == 0)
+			continue;
+		fprintf(out, "%s[%llu, %llu]", sep, coro_hist_bucket_min(i),
+			h->buckets[i]);
+		sep = ", ";
 	}
-	siglongjmp(coro_sched.ctx, 1);
+	fprintf(out, "]}");
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+void
+coro_telemetry_dump(const struct coro_telemetry *t, FILE *out)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
-	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
+	fprintf(out, "{\"slice\": ");
+	coro_hist_dump(&t->slice, out);
+	fprintf(out, ", \"wait\": ");
+	coro_hist_dump(&t->wait, out);
+	fprintf(out, ", \"switch_cost\": ");
+	coro_hist_dump(&t->switch_cost, out);
+	fprintf(out, "}");
+}
+
+#if CORO_CTX_ASM
+
+/**
+ * Save callee-saved registers on the current stack, store the stack
+ * pointer into @a from_sp, switch to @a to_sp and restore the
+ * registers saved there. Returns when somebody switches back.
+ */
+void
+coro_ctx_switch(void **from_sp, void *to_sp);
+
+/**
+ * The first code executed on a new coroutine stack. Calls the
+ * function, stored in a callee-saved register, with the argument
+ * stored in another one. The function never returns.
+ */
+void
+coro_ctx_start(void);
+
+#if defined(__x86_64__)
+
+__asm__(
+	".text\n"
+	".globl coro_ctx_switch\n"
+	".hidden coro_ctx_switch\n"
+	".type coro_ctx_switch, @function\n"
+	"coro_ctx_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coro_ctx_switch, .-coro_ctx_switch\n"
+	".globl coro_ctx_start\n"
+	".hidden coro_ctx_start\n"
+	".type coro_ctx_start, @function\n"
+	"coro_ctx_start:\n"
+	"	movq %r12, %rdi\n"
+	"	callq *%r13\n"
+	"	ud2\n"
+	".size coro_ctx_start, .-coro_ctx_start\n"
+);
+
+enum {
+	/** Saved words: r15, r14, r13, r12, rbx, rbp, return address. */
+	CORO_CTX_FRAME_WORDS = 7,
+	CORO_CTX_FRAME_ARG = 3,
+	CORO_CTX_FRAME_FUNC = 2,
+	CORO_CTX_FRAME_RET = 6,
+	/**
+	 * The frame is placed so as the stack is 16-byte aligned
+	 * after 'ret' into coro_ctx_start, like the ABI expects
+	 * right before a 'call'.
 	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
+	CORO_CTX_FRAME_OFFSET = 9,
+};
+
+#elif defined(__aarch64__)
+
+__asm__(
+	".text\n"
+	".globl coro_ctx_switch\n"
+	".hidden coro_ctx_switch\n"
+	".type coro_ctx_switch, %function\n"
+	"coro_ctx_switch:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x2, sp\n"
+	"	str x2, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size coro_ctx_switch, .-coro_ctx_switch\n"
+	".globl coro_ctx_start\n"
+	".hidden coro_ctx_start\n"
+	".type coro_ctx_start, %function\n"
+	"coro_ctx_start:\n"
+	"	mov x0, x19\n"
+	"	blr x20\n"
+	"	brk #0\n"
+	".size coro_ctx_start, .-coro_ctx_start\n"
+);
+
+enum {
+	/** Saved words: x19-x30, d8-d15. */
+	CORO_CTX_FRAME_WORDS = 20,
+	CORO_CTX_FRAME_ARG = 0,
+	CORO_CTX_FRAME_FUNC = 1,
+	/** x30, the link register. */
+	CORO_CTX_FRAME_RET = 11,
+	CORO_CTX_FRAME_OFFSET = 20,
+};
+
+#endif
+
+/**
+ * Prepare a context, which on the first switch to it calls @a func
+ * with @a arg on the given stack.
+ */
+static void
+coro_ctx_init(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*func)(void *), void *arg)
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	void **frame = (void **)top - CORO_CTX_FRAME_OFFSET;
+	memset(frame, 0, CORO_CTX_FRAME_WORDS * sizeof(void *));
+	frame[CORO_CTX_FRAME_ARG] = arg;
+	frame[CORO_CTX_FRAME_FUNC] = (void *)func;
+	frame[CORO_CTX_FRAME_RET] = (void *)coro_ctx_start;
+	ctx->sp = frame;
+}
+
+static inline void
+coro_ctx_jump(struct coro_ctx *from, struct coro_ctx *to)
+{
+	coro_ctx_switch(&from->sp, to->sp);
+}
+
+#else /* ! CORO_CTX_ASM */
+
+static inline void
+coro_ctx_jump(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
+}
+
+#endif /* CORO_CTX_ASM */
+
+static inline bool
+coro_sched_has_telemetry(struct coro_scheduler *s)
+{
+	return __atomic_load_n(&s->has_telemetry, __ATOMIC_RELAXED);
+}
+
+/** Account the runtime of a fair-share coroutine. */
+static inline void
+coro_fair_account(struct coro *c)
+{
+	if (c->policy != CORO_SCHED_FAIR)
+		return;
+	unsigned long long now = coro_now_ns();
+	c->vruntime += (now - c->vruntime_start) * CORO_WEIGHT_DEFAULT /
+		       c->weight;
+	c->vruntime_start = now;
+}
+
+/** The coroutine is switched in, its runtime starts to go. */
+static inline void
+coro_fair_resume(struct coro *c)
+{
+	if (c->policy == CORO_SCHED_FAIR)
+		c->vruntime_start = coro_now_ns();
+}
+
+/**
+ * Request preemption of the coroutine, running on the worker, if
+ * @a c is more urgent.
+ */
+static inline void
+coro_worker_kick(struct coro_worker *w, const struct coro *c)
+{
+	if (w->preempt_flag != NULL && coro_preempt_key(c) <
+	    __atomic_load_n(&w->running_key, __ATOMIC_RELAXED))
+		*w->preempt_flag = 1;
+}
+
+/** The coroutine is going to be put into a ready queue. */
+static inline void
+coro_telemetry_ready(struct coro *c)
+{
+	if (c->telemetry != NULL)
+		c->ready_time = coro_now_ns();
+}
+
+/**
+ * A switch from the current coroutine @a c is about to start.
+ * Ends its time slice.
+ */
+static inline void
+coro_telemetry_suspend(struct coro_worker *w, struct coro *c)
+{
+	if (! coro_sched_has_telemetry(w->scheduler))
+		return;
+	unsigned long long now = coro_now_ns();
+	w->switch_time = now;
+	if (c->telemetry != NULL)
+		coro_hist_add(&c->telemetry->slice, now - c->run_time);
+}
+
+/** The coroutine @a c is switched in. Starts its time slice. */
+static inline void
+coro_telemetry_resume(struct coro_worker *w, struct coro *c)
+{
+	if (c->telemetry == NULL)
+		return;
+	unsigned long long now = coro_now_ns();
+	coro_hist_add(&c->telemetry->switch_cost, now - w->switch_time);
+	coro_hist_add(&c->telemetry->wait, now - c->ready_time);
+	c->run_time = now;
+}
+
+/** Wake up a sleeping worker, if any, to take a new coroutine. */
+static void
+coro_sched_wakeup_worker(struct coro_scheduler *s)
+{
+	if (__atomic_load_n(&s->idle_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	pthread_mutex_lock(&s->mutex);
+	pthread_cond_signal(&s->work_cond);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+/** Put a coroutine into the ready queue of a worker. */
+static void
+coro_worker_push(struct coro_worker *w, struct coro *c)
+{
+	struct coro_scheduler *s = w->scheduler;
+	coro_telemetry_ready(c);
+	if (! s->is_mt) {
+		coro_runq_push(&w->ready, c);
+		coro_worker_kick(w, c);
+		return;
+	}
+	pthread_mutex_lock(&w->mutex);
+	coro_runq_push(&w->ready, c);
+	/* The coroutine can't be stolen and finished meanwhile. */
+	coro_worker_kick(w, c);
+	pthread_mutex_unlock(&w->mutex);
+	coro_sched_wakeup_worker(s);
+}
+
+/** Move the coroutines, woken up by other threads, to the ready queue. */
+static void
+coro_sched_drain_remote(struct coro_scheduler *s, struct coro_worker *w)
+{
+	if (! __atomic_load_n(&s->has_remote, __ATOMIC_ACQUIRE))
+		return;
+	pthread_mutex_lock(&s->mutex);
+	struct coro *c;
+	while ((c = coro_queue_pop(&s->remote)) != NULL)
+		coro_runq_push(&w->ready, c);
+	__atomic_store_n(&s->has_remote, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+/**
+ * Take a next coroutine to run on the worker instead of @a from,
+ * NULL if @a from should go on. Any coroutine, if @a from is NULL.
+ * In M:N mode, if the worker has nothing to do, it steals from the
+ * others.
+ */
+static struct coro *
+coro_worker_pop(struct coro_worker *w, const struct coro *from)
+{
+	struct coro_scheduler *s = w->scheduler;
+	if (! s->is_mt) {
+		coro_sched_drain_remote(s, w);
+		return coro_runq_pop(&w->ready, from);
+	}
+	pthread_mutex_lock(&w->mutex);
+	struct coro *c = coro_runq_pop(&w->ready, from);
+	bool is_empty = coro_runq_peek(&w->ready) == NULL;
+	pthread_mutex_unlock(&w->mutex);
+	if (c != NULL || ! is_empty)
+		return c;
+	int count = s->worker_count;
+	int self = w - s->workers;
+	for (int i = 1; i < count && c == NULL; ++i) {
+		struct coro_worker *victim = &s->workers[(self + i) % count];
+		pthread_mutex_lock(&victim->mutex);
+		c = coro_runq_pop(&victim->ready, from);
+		pthread_mutex_unlock(&victim->mutex);
+	}
+	return c;
+}
+
+static void
+coro_wakeup(struct coro *c);
+
+/**
+ * Put the coroutine, which has just switched away, where it
+ * belongs: to the finished queue or back to the ready one. Called
+ * right after each switch, in the new context.
+ */
+static void
+coro_worker_after_switch(struct coro_worker *w)
+{
+	struct coro *c = w->switched_from;
+	if (c == NULL)
+		return;
+	w->switched_from = NULL;
+	if (c->park_cb != NULL) {
+		coro_park_f cb = c->park_cb;
+		c->park_cb = NULL;
+		cb(c, c->park_arg);
+		return;
+	}
+	if (! c->is_finished) {
+		coro_worker_push(w, c);
+		return;
+	}
+	/* Nothing to save from a finished coroutine's stack. */
+	if (c->shared_stack != NULL && c->shared_stack->owner == c)
+		c->shared_stack->owner = NULL;
+	struct coro_scheduler *s = w->scheduler;
+	if (s->is_mt)
+		pthread_mutex_lock(&s->mutex);
+	c->is_done = true;
+	struct coro *joiner = c->joiner;
+	if (c->is_joined || c->is_joinable)
+		__atomic_sub_fetch(&s->coro_count, 1, __ATOMIC_RELAXED);
+	else
+		coro_queue_push(&s->finished, c);
+	if (s->is_mt) {
+		/* Both coro_sched_wait() and coro_join() can wait. */
+		pthread_cond_broadcast(&s->finished_cond);
+		pthread_mutex_unlock(&s->mutex);
+	}
+	/* The joiner is parked, its park callback has unlocked. */
+	if (joiner != NULL)
+		coro_wakeup(joiner);
+}
+
+#if CORO_CTX_ASM
+
+static inline char *
+coro_shared_stack_top(struct coro_shared_stack *ss)
+{
+	return (char *)coro_stack_bottom(&ss->stack) +
+	       coro_stack_size(&ss->stack);
+}
+
+/**
+ * Give the shared stack to @a c. The live part of the owner's stack,
+ * from its saved stack pointer to the top, is copied out to a heap
+ * buffer of about the same size, and the one of @a c is copied in.
+ * Must not be called on the shared stack itself.
+ */
+static void
+coro_shared_stack_acquire(struct coro *c)
+{
+	struct coro_shared_stack *ss = c->shared_stack;
+	struct coro *owner = ss->owner;
+	char *top = coro_shared_stack_top(ss);
+	if (owner != NULL) {
+		char *sp = owner->ctx.sp;
+		size_t size = top - sp;
+		if (size > owner->saved_capacity ||
+		    size < owner->saved_capacity / 4) {
+			free(owner->saved);
+			owner->saved = malloc(size);
+			owner->saved_capacity = size;
+		}
+		memcpy(owner->saved, sp, size);
+		owner->saved_size = size;
+	}
+	memcpy(top - c->saved_size, c->saved, c->saved_size);
+	ss->owner = c;
+}
+
+/** The copier loop. Each iteration is one switch. */
+static void
+coro_copier_f(void *arg)
+{
+	struct coro_worker *w = arg;
+	while (true) {
+		struct coro *to = w->copy_to;
+		coro_shared_stack_acquire(to);
+		coro_ctx_switch(&w->copier_ctx.sp, to->ctx.sp);
+	}
+}
+
+/**
+ * Switch from @a from to @a to, bringing the stack of @a to back,
+ * if it is shared and is not on its place.
+ */
+static inline void
+coro_jump(struct coro_worker *w, struct coro *from, struct coro *to)
+{
+	struct coro_shared_stack *ss = to->shared_stack;
+	if (ss == NULL || ss->owner == to) {
+		coro_ctx_jump(&from->ctx, &to->ctx);
+		return;
+	}
+	if (from->shared_stack != ss) {
+		coro_shared_stack_acquire(to);
+		coro_ctx_jump(&from->ctx, &to->ctx);
+		return;
+	}
+	/* The stack can't be overwritten while running on it. */
+	if (! w->has_copier) {
+		coro_stack_new(&w->copier_stack, CORO_COPIER_STACK_SIZE, true);
+		coro_ctx_init(&w->copier_ctx,
+			      coro_stack_bottom(&w->copier_stack),
+			      coro_stack_size(&w->copier_stack),
+			      coro_copier_f, w);
+		w->has_copier = true;
+	}
+	w->copy_to = to;
+	coro_ctx_jump(&from->ctx, &w->copier_ctx);
+}
+
+#else /* ! CORO_CTX_ASM */
+
+static inline void
+coro_jump(struct coro_worker *w, struct coro *from, struct coro *to)
+{
+	(void)w;
+	coro_ctx_jump(&from->ctx, &to->ctx);
+}
+
+#endif /* CORO_CTX_ASM */
+
+/**
+ * Switch the current coroutine to an arbitrary one. In M:N mode
+ * the current one can be resumed later in another thread.
+ */
+static void
+coro_yield_to(struct coro *to)
+{
+	struct coro_worker *w = coro_worker_this();
+	struct coro *from = w->this_ptr;
+	++from->switch_count;
+	w->this_ptr = to;
+	__atomic_store_n(&w->running_key,
+			 to == &w->sched ? 0 : coro_preempt_key(to),
+			 __ATOMIC_RELAXED);
+	/* The next coroutine gets a new time slice. */
+	coro_preempt_requested = 0;
+	coro_telemetry_suspend(w, from);
+	coro_jump(w, from, to);
+	w = coro_worker_this();
+	w->this_ptr = from;
+	coro_telemetry_resume(w, from);
+	coro_fair_resume(from);
+	coro_worker_after_switch(w);
+}
+
+void
+coro_yield(void)
+{
+	coro_preempt_requested = 0;
+	struct coro_worker *w = coro_worker_this();
+	/*
+	 * The scheduler is not in the ready queue, it gets control
+	 * back when a coroutine finishes.
+	 */
+	if (w == NULL || w->this_ptr == &w->sched)
+		return;
+	struct coro *from = w->this_ptr;
+	coro_fair_account(from);
+	struct coro *to = coro_worker_pop(w, from);
+	if (to == NULL)
+		return;
+	w->switched_from = from;
+	coro_yield_to(to);
+}
+
+/**
+ * Take the current coroutine off the run queues. @a cb is called
+ * right after the switch, and somebody has to wake the coroutine
+ * up with coro_wakeup() later. Returns after the wakeup.
+ */
+static void
+coro_park(coro_park_f cb, void *arg)
+{
+	struct coro_worker *w = coro_worker_this();
+	struct coro *c = w->this_ptr;
+	c->park_cb = cb;
+	c->park_arg = arg;
+	w->switched_from = c;
+	coro_fair_account(c);
+	struct coro *to = coro_worker_pop(w, NULL);
+	coro_yield_to(to != NULL ? to : &w->sched);
+}
+
+static void
+coro_park_unlock(struct coro *c, void *arg)
+{
+	(void)c;
+	pthread_mutex_unlock(arg);
+}
+
+static void
+coro_park_none(struct coro *c, void *arg)
+{
+	(void)c;
+	(void)arg;
+}
+
+/**
+ * Make a parked coroutine ready to run. Can be called from any
+ * thread, including the ones of other schedulers.
+ */
+static void
+coro_wakeup(struct coro *c)
+{
+	struct coro_scheduler *s = c->scheduler;
+	struct coro_worker *w = coro_worker_this();
+	if (w != NULL && w->scheduler == s) {
+		coro_worker_push(w, c);
+		return;
+	}
+	/*
+	 * A foreign thread. Once the coroutine is pushed, it can
+	 * finish, and the scheduler can be deleted, unless it waits
+	 * for this wakeup to complete.
+	 */
+	__atomic_add_fetch(&s->foreign_wakeup_count, 1, __ATOMIC_SEQ_CST);
+	if (s->is_mt) {
+		int i = __atomic_fetch_add(&s->next_worker, 1,
+					   __ATOMIC_RELAXED);
+		coro_worker_push(&s->workers[i % s->worker_count], c);
+	} else {
+		coro_telemetry_ready(c);
+		pthread_mutex_lock(&s->mutex);
+		coro_queue_push(&s->remote, c);
+		coro_worker_kick(&s->workers[0], c);
+		__atomic_store_n(&s->has_remote, true, __ATOMIC_RELEASE);
+		pthread_cond_signal(&s->work_cond);
+		pthread_mutex_unlock(&s->mutex);
+	}
+	__atomic_sub_fetch(&s->foreign_wakeup_count, 1, __ATOMIC_RELEASE);
+}
+
+static void
+coro_preempt_handler(int signum)
+{
+	(void)signum;
+	coro_preempt_requested = 1;
+}
+
+static void
+coro_preempt_handler_install(void)
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = coro_preempt_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(CORO_PREEMPT_SIGNAL, &sa, NULL) != 0)
+		handle_error();
+}
+
+/**
+ * Arm the preemption timer of the current thread's worker with a
+ * new interval, or disarm it if the interval is 0.
+ */
+static int
+coro_worker_preempt_update(struct coro_worker *w, long long quantum)
+{
+	if (quantum == w->preempt_quantum)
+		return 0;
+#ifdef SIGEV_THREAD_ID
+	if (quantum == 0) {
+		timer_delete(w->preempt_timer);
+		w->preempt_quantum = 0;
+		return 0;
+	}
+	if (w->preempt_quantum == 0) {
+		static pthread_once_t once = PTHREAD_ONCE_INIT;
+		pthread_once(&once, coro_preempt_handler_install);
+		/* The signal goes exactly to this thread. */
+		struct sigevent sev;
+		memset(&sev, 0, sizeof(sev));
+		sev.sigev_notify = SIGEV_THREAD_ID;
+		sev.sigev_signo = CORO_PREEMPT_SIGNAL;
+		sev._sigev_un._tid = syscall(SYS_gettid);
+		if (timer_create(CLOCK_MONOTONIC, &sev, &w->preempt_timer) != 0)
+			return -1;
+	}
+	struct itimerspec its;
+	its.it_interval.tv_sec = quantum / 1000000;
+	its.it_interval.tv_nsec = quantum % 1000000 * 1000;
+	its.it_value = its.it_interval;
+	if (timer_settime(w->preempt_timer, 0, &its, NULL) != 0) {
+		timer_delete(w->preempt_timer);
+		w->preempt_quantum = 0;
+		return -1;
+	}
+	w->preempt_quantum = quantum;
+	return 0;
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+int
+coro_sched_preempt(long long quantum)
+{
+	struct coro_scheduler *s = coro_sched_ptr;
+	if (quantum < 0)
+		quantum = 0;
+	__atomic_store_n(&s->preempt_quantum, quantum, __ATOMIC_RELAXED);
+	if (s->is_mt) {
+#ifdef SIGEV_THREAD_ID
+		/* The workers arm their timers themselves. */
+		return 0;
+#else
+		errno = ENOTSUP;
+		return -1;
+#endif
+	}
+	return coro_worker_preempt_update(&s->workers[0], quantum);
+}
+
+void
+coro_sched_telemetry(bool enable)
+{
+	__atomic_store_n(&coro_sched_ptr->has_telemetry, enable,
+			 __ATOMIC_RELAXED);
+}
+
+void
+coro_sched_policy(enum coro_sched_policy policy)
+{
+	if (policy == CORO_SCHED_DEFAULT)
+		policy = CORO_SCHED_RR;
+	__atomic_store_n(&coro_sched_ptr->policy, policy, __ATOMIC_RELAXED);
+}
+
+/** Create a scheduler with @a count workers. */
+static struct coro_scheduler *
+coro_sched_create(int count, bool is_mt)
+{
+	struct coro_scheduler *s = calloc(1, sizeof(*s));
+	struct coro_worker *workers = calloc(count, sizeof(*workers));
+	s->workers = workers;
+	s->worker_count = count;
+	s->is_mt = is_mt;
+	s->policy = CORO_SCHED_RR;
+	pthread_mutex_init(&s->mutex, NULL);
+	pthread_cond_init(&s->finished_cond, NULL);
+	pthread_cond_init(&s->work_cond, NULL);
+	for (int i = 0; i < count; ++i) {
+		workers[i].this_ptr = &workers[i].sched;
+		workers[i].scheduler = s;
+		pthread_mutex_init(&workers[i].mutex, NULL);
+	}
+	return s;
+}
+
+struct coro_scheduler *
+coro_scheduler_new(void)
+{
+	return coro_sched_create(1, false);
+}
+
+/** Worker thread loop in M:N mode. */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *w = arg;
+	struct coro_scheduler *s = w->scheduler;
+	coro_worker_ptr = w;
+	coro_sched_ptr = s;
+	w->preempt_flag = &coro_preempt_requested;
+	while (true) {
+		coro_worker_preempt_update(
+			w, __atomic_load_n(&s->preempt_quantum, __ATOMIC_RELAXED));
+		struct coro *c = coro_worker_pop(w, NULL);
+		if (c != NULL) {
+			coro_yield_to(c);
+			continue;
+		}
+		pthread_mutex_lock(&s->mutex);
+		__atomic_add_fetch(&s->idle_count, 1, __ATOMIC_SEQ_CST);
+		/*
+		 * Check again under the lock, a coroutine could be
+		 * pushed before the worker became idle.
+		 */
+		c = coro_worker_pop(w, NULL);
+		if (c == NULL && ! s->is_stopping)
+			pthread_cond_wait(&s->work_cond, &s->mutex);
+		__atomic_sub_fetch(&s->idle_count, 1, __ATOMIC_SEQ_CST);
+		bool is_stopping = s->is_stopping;
+		pthread_mutex_unlock(&s->mutex);
+		if (c != NULL)
+			coro_yield_to(c);
+		else if (is_stopping)
+			break;
+	}
+	coro_worker_preempt_update(w, 0);
+	return NULL;
+}
+
+struct coro_scheduler *
+coro_scheduler_new_mt(int thread_count)
+{
+	if (thread_count < 1)
+		thread_count = 1;
+	struct coro_scheduler *s = coro_sched_create(thread_count, true);
+	for (int i = 0; i < thread_count; ++i) {
+		errno = pthread_create(&s->workers[i].thread, NULL,
+				       coro_worker_f, &s->workers[i]);
+		if (errno != 0)
+			handle_error();
+	}
+	return s;
+}
+
+void
+coro_scheduler_delete(struct coro_scheduler *s)
+{
+	while (__atomic_load_n(&s->foreign_wakeup_count, __ATOMIC_ACQUIRE) > 0)
+		sched_yield();
+	if (s->is_mt) {
+		pthread_mutex_lock(&s->mutex);
+		s->is_stopping = true;
+		pthread_cond_broadcast(&s->work_cond);
+		pthread_mutex_unlock(&s->mutex);
+		for (int i = 0; i < s->worker_count; ++i)
+			pthread_join(s->workers[i].thread, NULL);
+	} else {
+		coro_worker_preempt_update(&s->workers[0], 0);
+	}
+	for (int i = 0; i < s->worker_count; ++i) {
+		pthread_mutex_destroy(&s->workers[i].mutex);
+		free(s->workers[i].ready.fair);
+		if (s->workers[i].has_copier)
+			coro_stack_delete(&s->workers[i].copier_stack);
+	}
+	if (coro_sched_ptr == s) {
+		coro_sched_ptr = NULL;
+		coro_worker_ptr = NULL;
+	}
+	free(s->workers);
+	pthread_mutex_destroy(&s->mutex);
+	pthread_cond_destroy(&s->finished_cond);
+	pthread_cond_destroy(&s->work_cond);
+	free(s);
+}
+
+void
+coro_scheduler_set(struct coro_scheduler *s)
+{
+	coro_sched_ptr = s;
+	coro_worker_ptr = NULL;
+	if (s != NULL && ! s->is_mt) {
+		/* This thread becomes the worker. */
+		coro_worker_ptr = &s->workers[0];
+		s->workers[0].preempt_flag = &coro_preempt_requested;
+	}
+}
+
+struct coro_scheduler *
+coro_scheduler_this(void)
+{
+	return coro_sched_ptr;
+}
+
+/** Replace the current thread's scheduler with @a s. */
+static void
+coro_sched_replace(struct coro_scheduler *s)
+{
+	if (coro_sched_ptr != NULL)
+		coro_scheduler_delete(coro_sched_ptr);
+	coro_scheduler_set(s);
+}
+
+void
+coro_sched_init(void)
+{
+	coro_sched_replace(coro_scheduler_new());
+}
+
+void
+coro_sched_init_mt(int thread_count)
+{
+	coro_sched_replace(coro_scheduler_new_mt(thread_count));
+}
+
+void
+coro_sched_destroy(void)
+{
+	coro_sched_replace(NULL);
+}
+
+/**
+ * Run the next ready coroutine of a single-threaded scheduler until
+ * it switches back to the scheduler, or wait for a wakeup from
+ * another thread if all the coroutines are parked.
+ */
+static void
+coro_sched_run_next(struct coro_scheduler *s)
+{
+	struct coro *c = coro_worker_pop(&s->workers[0], NULL);
+	if (c == NULL) {
+		/*
+		 * All the coroutines are parked. Wait until another
+		 * thread wakes some of them up.
+		 */
+		pthread_mutex_lock(&s->mutex);
+		while (! s->has_remote)
+			pthread_cond_wait(&s->work_cond, &s->mutex);
+		pthread_mutex_unlock(&s->mutex);
+		return;
+	}
+	s->is_waiting = true;
+	coro_yield_to(c);
+	s->is_waiting = false;
+}
+
+struct coro *
+coro_sched_wait(void)
+{
+	struct coro_scheduler *s = coro_sched_ptr;
+	if (s == NULL)
+		return NULL;
+	if (s->is_mt) {
+		pthread_mutex_lock(&s->mutex);
+		struct coro *c = NULL;
+		while (__atomic_load_n(&s->coro_count, __ATOMIC_RELAXED) > 0 &&
+		       (c = coro_queue_pop(&s->finished)) == NULL)
+			pthread_cond_wait(&s->finished_cond, &s->mutex);
+		if (c != NULL)
+			__atomic_sub_fetch(&s->coro_count, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&s->mutex);
+		return c;
+	}
+	while (s->coro_count > 0) {
+		struct coro *c = coro_queue_pop(&s->finished);
+		if (c != NULL) {
+			--s->coro_count;
+			return c;
+		}
+		coro_sched_run_next(s);
+	}
+	return NULL;
+}
+
+int
+coro_join(struct coro *c)
+{
+	struct coro_scheduler *s = c->scheduler;
+	struct coro_worker *w = coro_worker_this();
+	bool is_coro = w != NULL && w->this_ptr != &w->sched;
+	if (is_coro ? w->scheduler != s : coro_sched_ptr != s) {
+		printf("Critical error - join of another scheduler's "
+		       "coroutine!\n");
+		exit(-1);
+	}
+	if (is_coro && w->this_ptr == c) {
+		printf("Critical error - coroutine joins itself!\n");
+		exit(-1);
+	}
+	if (s->is_mt)
+		pthread_mutex_lock(&s->mutex);
+	if (c->is_joined) {
+		printf("Critical error - coroutine is joined twice!\n");
+		exit(-1);
+	}
+	c->is_joined = true;
+	if (c->is_done) {
+		/*
+		 * Already finished. A joinable one is not in the
+		 * finished queue and is not counted already.
+		 */
+		if (! c->is_joinable) {
+			coro_queue_remove(&s->finished, c);
+			__atomic_sub_fetch(&s->coro_count, 1,
+					   __ATOMIC_RELAXED);
+		}
+		if (s->is_mt)
+			pthread_mutex_unlock(&s->mutex);
+		return c->ret;
+	}
+	if (is_coro) {
+		/* Woken up by the scheduler when the coroutine is done. */
+		c->joiner = w->this_ptr;
+		if (s->is_mt)
+			coro_park(coro_park_unlock, &s->mutex);
+		else
+			coro_park(coro_park_none, NULL);
+	} else if (s->is_mt) {
+		while (! c->is_done)
+			pthread_cond_wait(&s->finished_cond, &s->mutex);
+		pthread_mutex_unlock(&s->mutex);
+	} else {
+		while (! c->is_done)
+			coro_sched_run_next(s);
+	}
+	return c->ret;
+}
+
+struct coro *
+coro_this(void)
+{
+	struct coro_worker *w = coro_worker_this();
+	return w != NULL ? w->this_ptr : NULL;
+}
+
+/**
+ * Run the coroutine function and hand the result to the scheduler.
+ * Called on the coroutine's own stack, never returns.
+ */
+static void
+coro_run(struct coro *c)
+{
+	struct coro_worker *w = coro_worker_this();
+	coro_telemetry_resume(w, c);
+	coro_fair_resume(c);
+	coro_worker_after_switch(w);
+	c->ret = c->func(c->func_arg);
+	c->is_finished = true;
+	w = coro_worker_this();
+	/* Can not return - 'ret' address is invalid already! */
+	if (! c->scheduler->is_mt && ! c->scheduler->is_waiting) {
+		printf("Critical error - no place to return!\n");
+		exit(-1);
+	}
+	/*
+	 * The coroutine is put into the finished queue after the
+	 * switch, when its stack is not used anymore.
+	 */
+	w->switched_from = c;
+	w->this_ptr = &w->sched;
+	__atomic_store_n(&w->running_key, 0, __ATOMIC_RELAXED);
+	coro_telemetry_suspend(w, c);
+	coro_ctx_jump(&c->ctx, &w->sched.ctx);
+}
+
+#if CORO_CTX_ASM
+
+static void
+coro_body(void *arg)
+{
+	coro_run(arg);
+}
+
+/**
+ * With the assembly backend a new context is just a small frame
+ * on top of the new stack. No syscalls. On a shared stack the frame
+ * is built in the saved stack buffer and is copied to the stack on
+ * the first switch.
+ */
+static void
+coro_ctx_create(struct coro *c)
+{
+	if (c->shared_stack == NULL) {
+		coro_ctx_init(&c->ctx, coro_stack_bottom(&c->stack),
+			      coro_stack_size(&c->stack), coro_body, c);
+		return;
+	}
+	/* Malloc gives 16 aligned memory, same as the stack top. */
+	size_t size = ((CORO_CTX_FRAME_OFFSET * sizeof(void *)) + 15) &
+		      ~(size_t)15;
+	char *buf = malloc(size);
+	coro_ctx_init(&c->ctx, buf, size, coro_body, c);
+	size_t used = buf + size - (char *)c->ctx.sp;
+	memmove(buf, c->ctx.sp, used);
+	c->saved = buf;
+	c->saved_size = used;
+	c->saved_capacity = size;
+	c->ctx.sp = coro_shared_stack_top(c->shared_stack) - used;
+}
+
+#else /* ! CORO_CTX_ASM */
+
+/**
+ * The core part of the coroutines creation - this signal handler
+ * is run on a separate stack using sigaltstack. On an invokation
+ * it remembers its current context and jumps back to the
+ * coroutine constructor. Later the coroutine continues from here.
+ */
+static void
+coro_body(int signum)
+{
+	(void)signum;
+	struct coro *c = coro_ctx_new_ptr;
+	coro_ctx_new_ptr = NULL;
+	/*
+	 * On an invokation jump back to the constructor right
+	 * after remembering the context.
+	 */
+	if (sigsetjmp(c->ctx.buf, 0) == 0)
+		siglongjmp(start_point, 1);
+	/*
+	 * If the execution is here, then the coroutine should
+	 * finaly start work.
+	 */
+	coro_run(c);
+}
+
+static void
+coro_ctx_create(struct coro *c)
+{
+	pthread_mutex_lock(&coro_ctx_create_mutex);
+	/*
+	 * SIGUSR2 is used. First of all, block new signals to be
+	 * able to set a new handler.
+	 */
+	sigset_t news, olds, suss;
+	sigemptyset(&news);
 	sigaddset(&news, SIGUSR2);
 	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
 		handle_error();
@@ -218,21 +2005,19 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
+	newst.ss_sp = coro_stack_bottom(&c->stack);
+	newst.ss_size = coro_stack_size(&c->stack);
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
+	coro_ctx_new_ptr = c;
 	sigemptyset(&suss);
 	if (sigsetjmp(start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
+		while (coro_ctx_new_ptr != NULL)
 			sigsuspend(&suss);
 	}
-	coro_this_ptr = old_this;
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
@@ -251,8 +2036,865 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+	pthread_mutex_unlock(&coro_ctx_create_mutex);
+}
+
+#endif /* CORO_CTX_ASM */
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_ex(func, func_arg, NULL);
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_opts *opts)
+{
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	c->ret = 0;
+	size_t stack_size = CORO_STACK_SIZE;
+	bool has_guard = true;
+	c->is_stack_painted = false;
+	c->policy = CORO_SCHED_DEFAULT;
+	c->priority = 0;
+	c->weight = CORO_WEIGHT_DEFAULT;
+	if (opts != NULL) {
+		if (opts->stack_size != 0)
+			stack_size = opts->stack_size;
+		c->is_stack_painted = opts->paint_stack;
+		has_guard = ! opts->no_guard_page;
+		c->policy = opts->policy;
+		if (opts->priority > 0)
+			c->priority = opts->priority > CORO_PRIO_MAX ?
+				      CORO_PRIO_MAX : opts->priority;
+		if (opts->weight != 0)
+			c->weight = opts->weight;
+	}
+	struct coro_scheduler *s = coro_sched_this();
+	if (s == NULL) {
+		printf("Critical error - no scheduler!\n");
+		exit(-1);
+	}
+	c->scheduler = s;
+	if (c->policy == CORO_SCHED_DEFAULT)
+		c->policy = __atomic_load_n(&s->policy, __ATOMIC_RELAXED);
+	c->vruntime = 0;
+	c->vruntime_start = 0;
+#if ! CORO_CTX_ASM
+	if (stack_size < (size_t)SIGSTKSZ)
+		stack_size = SIGSTKSZ;
+#endif
+	c->shared_stack = NULL;
+	c->saved = NULL;
+	c->saved_size = 0;
+	c->saved_capacity = 0;
+#if CORO_CTX_ASM
+	if (opts != NULL && opts->shared_stack != NULL && ! s->is_mt)
+		c->shared_stack = opts->shared_stack;
+#endif
+	if (c->shared_stack != NULL) {
+		c->is_stack_painted = false;
+	} else {
+		coro_stack_new(&c->stack, stack_size, has_guard);
+		if (c->is_stack_painted)
+			coro_stack_paint(&c->stack);
+	}
+	c->func = func;
+	c->func_arg = func_arg;
+	c->is_finished = false;
+	c->switch_count = 0;
+	c->park_cb = NULL;
+	c->park_arg = NULL;
+	c->is_joined = false;
+	c->is_joinable = opts != NULL && opts->joinable;
+	c->is_done = false;
+	c->joiner = NULL;
+	c->telemetry = NULL;
+	if (coro_sched_has_telemetry(s))
+		c->telemetry = calloc(1, sizeof(*c->telemetry));
+	coro_ctx_create(c);
 
 	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+	__atomic_add_fetch(&s->coro_count, 1, __ATOMIC_RELAXED);
+	struct coro_worker *w = coro_worker_this();
+	if (w == NULL) {
+		/* Created outside of the workers - distribute. */
+		int i = __atomic_fetch_add(&s->next_worker, 1,
+					   __ATOMIC_RELAXED);
+		w = &s->workers[i % s->worker_count];
+	}
+	coro_worker_push(w, c);
+	return c;
+}
+
+enum coro_io_op {
+	CORO_IO_READ,
+	CORO_IO_WRITE,
+	CORO_IO_OPEN,
+};
+
+/** I/O request of a parked coroutine. */
+struct coro_io {
+	enum coro_io_op op;
+	int fd;
+	void *buf;
+	size_t size;
+	const char *path;
+	int flags;
+	mode_t mode;
+	/** Result like of the syscall, but -errno on error. */
+	long res;
+	/** Coroutine waiting for the result. */
+	struct coro *coro;
+	/** Link in the offload threads queue. */
+	struct coro_io *next;
+};
+
+enum {
+	/** Number of I/O threads when io_uring is not available. */
+	CORO_IO_THREAD_COUNT = 4,
+	CORO_IO_URING_ENTRIES = 256,
+};
+
+/**
+ * I/O engine. It is created on the first I/O from a coroutine and
+ * lives until the process exits.
+ */
+static struct {
+	pthread_once_t once;
+	/** Protects the submission ring or the offload queue. */
+	pthread_mutex_t mutex;
+	/** True, if the requests are submitted to io_uring. */
+	bool has_uring;
+#if CORO_IO_URING
+	int ring_fd;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+#endif
+	/** Queue of the offload threads. */
+	struct coro_io *first, *last;
+	pthread_cond_t cond;
+} coro_io_engine = {
+	.once = PTHREAD_ONCE_INIT,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/** Do the I/O right in the current thread. */
+static long
+coro_io_exec(struct coro_io *io)
+{
+	long res = -1;
+	switch (io->op) {
+	case CORO_IO_READ:
+		res = read(io->fd, io->buf, io->size);
+		break;
+	case CORO_IO_WRITE:
+		res = write(io->fd, io->buf, io->size);
+		break;
+	case CORO_IO_OPEN:
+		res = open(io->path, io->flags, io->mode);
+		break;
+	}
+	return res < 0 ? -errno : res;
+}
+
+static void *
+coro_io_thread_f(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&coro_io_engine.mutex);
+	while (true) {
+		struct coro_io *io = coro_io_engine.first;
+		if (io == NULL) {
+			pthread_cond_wait(&coro_io_engine.cond,
+					  &coro_io_engine.mutex);
+			continue;
+		}
+		coro_io_engine.first = io->next;
+		if (io->next == NULL)
+			coro_io_engine.last = NULL;
+		pthread_mutex_unlock(&coro_io_engine.mutex);
+		io->res = coro_io_exec(io);
+		coro_wakeup(io->coro);
+		pthread_mutex_lock(&coro_io_engine.mutex);
+	}
+	return NULL;
+}
+
+/** Start a thread, which lives until the process exits. */
+static void
+coro_io_thread_start(void *(*func)(void *))
+{
+	pthread_t thread;
+	errno = pthread_create(&thread, NULL, func, NULL);
+	if (errno != 0)
+		handle_error();
+	pthread_detach(thread);
+}
+
+#if CORO_IO_URING
+
+/** Take the completions from io_uring and wake the coroutines up. */
+static void *
+coro_io_uring_reaper_f(void *arg)
+{
+	(void)arg;
+	while (true) {
+		unsigned head = *coro_io_engine.cq_head;
+		unsigned tail = __atomic_load_n(coro_io_engine.cq_tail,
+						__ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (syscall(__NR_io_uring_enter, coro_io_engine.ring_fd,
+				    0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+			    errno != EINTR)
+				handle_error();
+			continue;
+		}
+		for (; head != tail; ++head) {
+			unsigned idx = head & *coro_io_engine.cq_mask;
+			struct io_uring_cqe *cqe = &coro_io_engine.cqes[idx];
+			struct coro_io *io =
+				(struct coro_io *)(uintptr_t)cqe->user_data;
+			io->res = cqe->res;
+			__atomic_store_n(coro_io_engine.cq_head, head + 1,
+					 __ATOMIC_RELEASE);
+			coro_wakeup(io->coro);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Create io_uring. Returns false, if the kernel doesn't have it,
+ * or it is too old to read from the current file position and to
+ * open files.
+ */
+static bool
+coro_io_uring_create(void)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, CORO_IO_URING_ENTRIES, &params);
+	if (fd < 0)
+		return false;
+	if ((params.features & IORING_FEAT_RW_CUR_POS) == 0) {
+		close(fd);
+		return false;
+	}
+	size_t sq_size = params.sq_off.array +
+			 params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes +
+			 params.cq_entries * sizeof(struct io_uring_cqe);
+	bool is_single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (is_single_map && cq_size > sq_size)
+		sq_size = cq_size;
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		handle_error();
+	char *cq = sq;
+	if (! is_single_map) {
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			handle_error();
+	}
+	void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		handle_error();
+	coro_io_engine.ring_fd = fd;
+	coro_io_engine.sq_entries = params.sq_entries;
+	coro_io_engine.sq_head = (unsigned *)(sq + params.sq_off.head);
+	coro_io_engine.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	coro_io_engine.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	coro_io_engine.sq_array = (unsigned *)(sq + params.sq_off.array);
+	coro_io_engine.sqes = sqes;
+	coro_io_engine.cq_head = (unsigned *)(cq + params.cq_off.head);
+	coro_io_engine.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	coro_io_engine.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	coro_io_engine.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	coro_io_thread_start(coro_io_uring_reaper_f);
+	return true;
+}
+
+static void
+coro_io_uring_submit(struct coro_io *io)
+{
+	pthread_mutex_lock(&coro_io_engine.mutex);
+	unsigned tail = *coro_io_engine.sq_tail;
+	unsigned head = __atomic_load_n(coro_io_engine.sq_head,
+					__ATOMIC_ACQUIRE);
+	if (tail - head >= coro_io_engine.sq_entries) {
+		/*
+		 * Can't happen normally - the kernel takes the entries
+		 * right in io_uring_enter() below.
+		 */
+		pthread_mutex_unlock(&coro_io_engine.mutex);
+		io->res = coro_io_exec(io);
+		coro_wakeup(io->coro);
+		return;
+	}
+	unsigned idx = tail & *coro_io_engine.sq_mask;
+	struct io_uring_sqe *sqe = &coro_io_engine.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	switch (io->op) {
+	case CORO_IO_READ:
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = io->fd;
+		sqe->addr = (uintptr_t)io->buf;
+		sqe->len = io->size > (1U << 30) ? (1U << 30) : io->size;
+		/* Read from the current file position. */
+		sqe->off = (uint64_t)-1;
+		break;
+	case CORO_IO_WRITE:
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = io->fd;
+		sqe->addr = (uintptr_t)io->buf;
+		sqe->len = io->size > (1U << 30) ? (1U << 30) : io->size;
+		sqe->off = (uint64_t)-1;
+		break;
+	case CORO_IO_OPEN:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)io->path;
+		sqe->len = io->mode;
+		sqe->open_flags = io->flags;
+		break;
+	}
+	sqe->user_data = (uintptr_t)io;
+	coro_io_engine.sq_array[idx] = idx;
+	__atomic_store_n(coro_io_engine.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	while (syscall(__NR_io_uring_enter, coro_io_engine.ring_fd, 1, 0, 0,
+		       NULL, 0) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			handle_error();
+	}
+	pthread_mutex_unlock(&coro_io_engine.mutex);
+}
+
+#endif /* CORO_IO_URING */
+
+static void
+coro_io_engine_create(void)
+{
+#if CORO_IO_URING
+	coro_io_engine.has_uring = coro_io_uring_create();
+	if (coro_io_engine.has_uring)
+		return;
+#endif
+	for (int i = 0; i < CORO_IO_THREAD_COUNT; ++i)
+		coro_io_thread_start(coro_io_thread_f);
+}
+
+/** Submit the I/O of a coroutine, which has just parked. */
+static void
+coro_io_submit(struct coro *c, void *arg)
+{
+	(void)c;
+	struct coro_io *io = arg;
+#if CORO_IO_URING
+	if (coro_io_engine.has_uring) {
+		coro_io_uring_submit(io);
+		return;
+	}
+#endif
+	io->next = NULL;
+	pthread_mutex_lock(&coro_io_engine.mutex);
+	if (coro_io_engine.last != NULL)
+		coro_io_engine.last->next = io;
+	else
+		coro_io_engine.first = io;
+	coro_io_engine.last = io;
+	pthread_cond_signal(&coro_io_engine.cond);
+	pthread_mutex_unlock(&coro_io_engine.mutex);
+}
+
+/**
+ * Do the I/O in background while the current coroutine is parked.
+ * Outside of coroutines just do it in place.
+ */
+static long
+coro_io_do(struct coro_io *io)
+{
+	struct coro_worker *w = coro_worker_this();
+	if (w == NULL || w->this_ptr == &w->sched)
+		return coro_io_exec(io);
+	pthread_once(&coro_io_engine.once, coro_io_engine_create);
+	struct coro *c = w->this_ptr;
+	if (c->shared_stack == NULL) {
+		io->coro = c;
+		coro_park(coro_io_submit, io);
+		return io->res;
+	}
+	/*
+	 * The stack can be swapped out while the I/O is in progress,
+	 * so the request has to live elsewhere.
+	 */
+	struct coro_io *heap_io = malloc(sizeof(*heap_io));
+	*heap_io = *io;
+	heap_io->coro = c;
+	coro_park(coro_io_submit, heap_io);
+	long res = heap_io->res;
+	free(heap_io);
+	return res;
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	struct coro_io io;
+	memset(&io, 0, sizeof(io));
+	io.op = CORO_IO_READ;
+	io.fd = fd;
+	io.buf = buf;
+	io.size = size;
+	long res = coro_io_do(&io);
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	struct coro_io io;
+	memset(&io, 0, sizeof(io));
+	io.op = CORO_IO_WRITE;
+	io.fd = fd;
+	io.buf = (void *)buf;
+	io.size = size;
+	long res = coro_io_do(&io);
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+int
+coro_open(const char *path, int flags, mode_t mode)
+{
+	struct coro_io io;
+	memset(&io, 0, sizeof(io));
+	io.op = CORO_IO_OPEN;
+	io.path = path;
+	io.flags = flags;
+	io.mode = mode;
+	long res = coro_io_do(&io);
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+/** FIFO queue of parked coroutines. */
+struct coro_wait_queue {
+	struct coro_waiter *first, *last;
+};
+
+static inline void
+coro_wait_queue_push(struct coro_wait_queue *q, struct coro_waiter *w)
+{
+	w->next = NULL;
+	if (q->last != NULL)
+		q->last->next = w;
+	else
+		q->first = w;
+	q->last = w;
+}
+
+static inline struct coro_waiter *
+coro_wait_queue_pop(struct coro_wait_queue *q)
+{
+	struct coro_waiter *w = q->first;
+	if (w == NULL)
+		return NULL;
+	q->first = w->next;
+	if (q->first == NULL)
+		q->last = NULL;
+	return w;
+}
+
+/**
+ * Park the current coroutine in @a q. @a lock protects the queue,
+ * it is locked by the caller and is unlocked when the coroutine
+ * has switched away. @a msg is for the waiter to carry. Returns the
+ * waiter after the wakeup.
+ */
+static struct coro_waiter *
+coro_wait(struct coro_wait_queue *q, pthread_mutex_t *lock, void *msg)
+{
+	struct coro_worker *w = coro_worker_this();
+	if (w == NULL || w->this_ptr == &w->sched) {
+		printf("Critical error - can't block outside of a coroutine!\n");
+		exit(-1);
+	}
+	struct coro_waiter *waiter = &w->this_ptr->waiter;
+	waiter->coro = w->this_ptr;
+	waiter->msg = msg;
+	waiter->is_ok = false;
+	coro_wait_queue_push(q, waiter);
+	coro_park(coro_park_unlock, lock);
+	return waiter;
+}
+
+struct coro_mutex {
+	/** Protects the fields below. */
+	pthread_mutex_t lock;
+	bool is_locked;
+	struct coro_wait_queue waiters;
+};
+
+struct coro_mutex *
+coro_mutex_new(void)
+{
+	struct coro_mutex *m = calloc(1, sizeof(*m));
+	pthread_mutex_init(&m->lock, NULL);
+	return m;
+}
+
+void
+coro_mutex_delete(struct coro_mutex *m)
+{
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}
+
+void
+coro_mutex_lock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	if (! m->is_locked) {
+		m->is_locked = true;
+		pthread_mutex_unlock(&m->lock);
+		return;
+	}
+	/* The ownership is handed over on unlock. */
+	coro_wait(&m->waiters, &m->lock, NULL);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	bool is_locked = ! m->is_locked;
+	m->is_locked = true;
+	pthread_mutex_unlock(&m->lock);
+	return is_locked;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	struct coro_waiter *w = coro_wait_queue_pop(&m->waiters);
+	if (w == NULL)
+		m->is_locked = false;
+	pthread_mutex_unlock(&m->lock);
+	if (w != NULL)
+		coro_wakeup(w->coro);
+}
+
+struct coro_cond {
+	/** Protects the waiters. */
+	pthread_mutex_t lock;
+	struct coro_wait_queue waiters;
+};
+
+struct coro_cond *
+coro_cond_new(void)
+{
+	struct coro_cond *c = calloc(1, sizeof(*c));
+	pthread_mutex_init(&c->lock, NULL);
 	return c;
 }
+
+void
+coro_cond_delete(struct coro_cond *c)
+{
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m)
+{
+	pthread_mutex_lock(&c->lock);
+	/*
+	 * The mutex is unlocked after the coroutine is in the queue,
+	 * so a signal sent right after the unlock is not lost.
+	 */
+	coro_mutex_unlock(m);
+	coro_wait(&c->waiters, &c->lock, NULL);
+	coro_mutex_lock(m);
+}
+
+void
+coro_cond_signal(struct coro_cond *c)
+{
+	pthread_mutex_lock(&c->lock);
+	struct coro_waiter *w = coro_wait_queue_pop(&c->waiters);
+	pthread_mutex_unlock(&c->lock);
+	if (w != NULL)
+		coro_wakeup(w->coro);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *c)
+{
+	pthread_mutex_lock(&c->lock);
+	struct coro_waiter *w = c->waiters.first;
+	c->waiters.first = c->waiters.last = NULL;
+	pthread_mutex_unlock(&c->lock);
+	while (w != NULL) {
+		/* The waiter is gone after the wakeup. */
+		struct coro_waiter *next = w->next;
+		coro_wakeup(w->coro);
+		w = next;
+	}
+}
+
+struct coro_chan {
+	/** Protects the fields below. */
+	pthread_mutex_t lock;
+	/** Ring buffer of the messages. */
+	void **buf;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	bool is_closed;
+	/** Senders, waiting for free space. */
+	struct coro_wait_queue senders;
+	/** Receivers, waiting for messages. */
+	struct coro_wait_queue receivers;
+};
+
+struct coro_chan *
+coro_chan_new(size_t capacity)
+{
+	if (capacity == 0)
+		capacity = 1;
+	struct coro_chan *ch = calloc(1, sizeof(*ch));
+	pthread_mutex_init(&ch->lock, NULL);
+	ch->buf = malloc(sizeof(*ch->buf) * capacity);
+	ch->capacity = capacity;
+	return ch;
+}
+
+void
+coro_chan_delete(struct coro_chan *ch)
+{
+	pthread_mutex_destroy(&ch->lock);
+	free(ch->buf);
+	free(ch);
+}
+
+int
+coro_chan_send(struct coro_chan *ch, void *msg)
+{
+	pthread_mutex_lock(&ch->lock);
+	if (ch->is_closed) {
+		pthread_mutex_unlock(&ch->lock);
+		return -1;
+	}
+	/* Receivers wait only when the buffer is empty. */
+	struct coro_waiter *w = coro_wait_queue_pop(&ch->receivers);
+	if (w != NULL) {
+		pthread_mutex_unlock(&ch->lock);
+		w->msg = msg;
+		w->is_ok = true;
+		coro_wakeup(w->coro);
+		return 0;
+	}
+	if (ch->count < ch->capacity) {
+		ch->buf[(ch->head + ch->count) % ch->capacity] = msg;
+		++ch->count;
+		pthread_mutex_unlock(&ch->lock);
+		return 0;
+	}
+	struct coro_waiter *waiter = coro_wait(&ch->senders, &ch->lock, msg);
+	return waiter->is_ok ? 0 : -1;
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void **msg)
+{
+	pthread_mutex_lock(&ch->lock);
+	if (ch->count > 0) {
+		*msg = ch->buf[ch->head];
+		ch->head = (ch->head + 1) % ch->capacity;
+		--ch->count;
+		/* Senders wait only when the buffer is full. */
+		struct coro_waiter *w = coro_wait_queue_pop(&ch->senders);
+		if (w != NULL) {
+			ch->buf[(ch->head + ch->count) % ch->capacity] = w->msg;
+			++ch->count;
+			w->is_ok = true;
+		}
+		pthread_mutex_unlock(&ch->lock);
+		if (w != NULL)
+			coro_wakeup(w->coro);
+		return 0;
+	}
+	if (ch->is_closed) {
+		pthread_mutex_unlock(&ch->lock);
+		return -1;
+	}
+	struct coro_waiter *waiter = coro_wait(&ch->receivers, &ch->lock,
+						NULL);
+	if (! waiter->is_ok)
+		return -1;
+	*msg = waiter->msg;
+	return 0;
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+	pthread_mutex_lock(&ch->lock);
+	ch->is_closed = true;
+	struct coro_waiter *receivers = ch->receivers.first;
+	struct coro_waiter *senders = ch->senders.first;
+	memset(&ch->receivers, 0, sizeof(ch->receivers));
+	memset(&ch->senders, 0, sizeof(ch->senders));
+	pthread_mutex_unlock(&ch->lock);
+	struct coro_waiter *next;
+	for (; receivers != NULL; receivers = next) {
+		next = receivers->next;
+		coro_wakeup(receivers->coro);
+	}
+	for (; senders != NULL; senders = next) {
+		next = senders->next;
+		coro_wakeup(senders->coro);
+	}
+}
+
+struct coro_wait_group {
+	/** Protects the fields below. */
+	pthread_mutex_t lock;
+	long long count;
+	struct coro_wait_queue waiters;
+};
+
+struct coro_wait_group *
+coro_wait_group_new(void)
+{
+	struct coro_wait_group *wg = calloc(1, sizeof(*wg));
+	pthread_mutex_init(&wg->lock, NULL);
+	return wg;
+}
+
+void
+coro_wait_group_delete(struct coro_wait_group *wg)
+{
+	pthread_mutex_destroy(&wg->lock);
+	free(wg);
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *wg, long long count)
+{
+	pthread_mutex_lock(&wg->lock);
+	wg->count += count;
+	if (wg->count < 0) {
+		printf("Critical error - negative wait group counter!\n");
+		exit(-1);
+	}
+	struct coro_waiter *w = NULL;
+	if (wg->count == 0) {
+		w = wg->waiters.first;
+		memset(&wg->waiters, 0, sizeof(wg->waiters));
+	}
+	pthread_mutex_unlock(&wg->lock);
+	while (w != NULL) {
+		struct coro_waiter *next = w->next;
+		coro_wakeup(w->coro);
+		w = next;
+	}
+}
+
+void
+coro_wait_group_done(struct coro_wait_group *wg)
+{
+	coro_wait_group_add(wg, -1);
+}
+
+void
+coro_wait_group_wait(struct coro_wait_group *wg)
+{
+	pthread_mutex_lock(&wg->lock);
+	if (wg->count == 0) {
+		pthread_mutex_unlock(&wg->lock);
+		return;
+	}
+	coro_wait(&wg->waiters, &wg->lock, NULL);
+}
+
+struct coro_gen {
+	/** Values on the way from the producer to the consumer. */
+	struct coro_chan *chan;
+	coro_gen_f func;
+	void *func_arg;
+	/** The producer and the consumer, whoever is the last frees. */
+	int ref_count;
+};
+
+static void
+coro_gen_unref(struct coro_gen *gen)
+{
+	if (__atomic_sub_fetch(&gen->ref_count, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	coro_chan_delete(gen->chan);
+	free(gen);
+}
+
+static int
+coro_gen_body(void *arg)
+{
+	struct coro_gen *gen = arg;
+	int res = gen->func(gen, gen->func_arg);
+	coro_chan_close(gen->chan);
+	coro_gen_unref(gen);
+	return res;
+}
+
+struct coro_gen *
+coro_gen_new(coro_gen_f func, void *func_arg)
+{
+	struct coro_gen *gen = malloc(sizeof(*gen));
+	gen->chan = coro_chan_new(1);
+	gen->func = func;
+	gen->func_arg = func_arg;
+	gen->ref_count = 2;
+	coro_new(coro_gen_body, gen);
+	return gen;
+}
+
+void
+coro_gen_delete(struct coro_gen *gen)
+{
+	/* Stop the producer, if it is still running. */
+	coro_chan_close(gen->chan);
+	coro_gen_unref(gen);
+}
+
+int
+coro_gen_yield(struct coro_gen *gen, void *value)
+{
+	return coro_chan_send(gen->chan, value);
+}
+
+int
+coro_gen_next(struct coro_gen *gen, void **value)
+{
+	return coro_chan_recv(gen->chan, value);
+}
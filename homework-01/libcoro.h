@@ -1,14 +1,161 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
 
-/** Make current context scheduler. */
+/**
+ * Execution stack, shared by a group of coroutines. Only one of
+ * them has its stack on it at a time. When another one is switched
+ * in, the live part of the owner's stack is copied out to a heap
+ * buffer of the same size, and the one of the new coroutine is
+ * copied back. So a parked coroutine takes as much memory as it
+ * really uses at the moment, for the price of the copying.
+ */
+struct coro_shared_stack;
+
+/** Create a shared stack, 1MB by default, like coro_opts.stack_size. */
+struct coro_shared_stack *
+coro_shared_stack_new(size_t size);
+
+/** Free the shared stack. Its coroutines should be deleted. */
+void
+coro_shared_stack_delete(struct coro_shared_stack *ss);
+
+/**
+ * Coroutine scheduler. Each thread can run its own one, and the
+ * schedulers share nothing but the stack pool and the I/O engine.
+ * Coroutines of different schedulers can talk via the channels and
+ * the other synchronization primitives.
+ */
+struct coro_scheduler;
+
+/**
+ * Create a scheduler, running the coroutines in the thread, which
+ * makes it current and waits for the coroutines with
+ * coro_sched_wait().
+ */
+struct coro_scheduler *
+coro_scheduler_new(void);
+
+/** Create a scheduler, running the coroutines on worker threads. */
+struct coro_scheduler *
+coro_scheduler_new_mt(int thread_count);
+
+/**
+ * Stop the worker threads, if any, and free the scheduler. Its
+ * coroutines should be finished and deleted.
+ */
+void
+coro_scheduler_delete(struct coro_scheduler *s);
+
+/**
+ * Make the scheduler current for the calling thread: coro_new(),
+ * coro_sched_wait() and the other coro_sched_*() functions work
+ * with it. A single-threaded scheduler should be current only in
+ * one thread. NULL detaches the thread from its scheduler.
+ */
+void
+coro_scheduler_set(struct coro_scheduler *s);
+
+/** Current scheduler of the thread, NULL if none. */
+struct coro_scheduler *
+coro_scheduler_this(void);
+
+/**
+ * Make current context scheduler. Replaces the current scheduler of
+ * the thread with a new single-threaded one.
+ */
 void
 coro_sched_init(void);
 
+/**
+ * Make the coroutines run on @a thread_count worker threads, M:N.
+ * Each worker has its own queue of ready coroutines and steals
+ * from the others when has nothing to do. A coroutine can be
+ * resumed in another thread after coro_yield(), so it should not
+ * keep pointers to thread-local data, like errno, across yields.
+ * The calling thread is not a worker, it only waits for the
+ * coroutines to finish. Replaces the current scheduler of the
+ * thread.
+ */
+void
+coro_sched_init_mt(int thread_count);
+
+/**
+ * Opt-in preemption. Each scheduler thread gets a timer, which
+ * every @a quantum microseconds sets coro_preempt_requested flag,
+ * and coroutines call coro_preempt_check() in hot loops instead of
+ * reading the clock. 0 disables the timers. Returns 0 on success,
+ * -1 if the timers are not supported. In M:N mode the workers arm
+ * their timers when they get back to their loop.
+ */
+int
+coro_sched_preempt(long long quantum);
+
+/**
+ * Check if the preemption timer of the current thread has ended the
+ * time slice. The flag is reset on each switch. It is per thread,
+ * and in M:N mode a coroutine can move to another thread on a
+ * switch, so the flag is read by a call, not inline: the compiler
+ * could reuse the address of the old thread's flag.
+ */
+bool
+coro_preempt_is_requested(void);
+
+/**
+ * Yield, if the time slice is over. Costs a call, a load and a
+ * branch, so it can be called on each iteration of the hottest
+ * loops.
+ */
+#define coro_preempt_check() do {					\
+	if (__builtin_expect(coro_preempt_is_requested(), 0))		\
+		coro_yield();						\
+} while (0)
+
+/**
+ * Scheduling policies. Ready coroutines of different policies are
+ * picked in this order: priority, round-robin, fair.
+ */
+enum coro_sched_policy {
+	/** The scheduler's default policy, for coro_opts. */
+	CORO_SCHED_DEFAULT = 0,
+	/** Strict priorities, round-robin among equal ones. */
+	CORO_SCHED_PRIO,
+	/** Take turns in FIFO order. The default. */
+	CORO_SCHED_RR,
+	/**
+	 * Weighted fair share of the CPU time, like CFS in Linux.
+	 * The coroutine with the least runtime, divided by its
+	 * weight, runs next. Reads the clock on each switch.
+	 */
+	CORO_SCHED_FAIR,
+};
+
+/** Priorities of CORO_SCHED_PRIO coroutines are from 0 to this. */
+#define CORO_PRIO_MAX 31
+
+/** Weight of CORO_SCHED_FAIR coroutines by default. */
+#define CORO_WEIGHT_DEFAULT 1024
+
+/**
+ * Set the policy for the coroutines created afterwards without a
+ * policy in coro_opts. Reset to round-robin by coro_sched_init*().
+ * Each worker applies the policies to its own queue. A coroutine,
+ * woken up with a higher priority than the running one, requests
+ * its preemption, as coro_preempt_is_requested() tells.
+ */
+void
+coro_sched_policy(enum coro_sched_policy policy);
+
+/** Delete the current scheduler of the thread. */
+void
+coro_sched_destroy(void);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
  * if no coroutines.
@@ -27,6 +174,82 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/** Options of a new coroutine. Zero means a default value. */
+struct coro_opts {
+	/**
+	 * Stack size in bytes. Is rounded up to a power of 2 pages.
+	 * By default 1MB.
+	 */
+	size_t stack_size;
+	/**
+	 * Fill the stack with a pattern on creation, to be able to
+	 * get its peak usage via coro_stack_used(). Commits the
+	 * whole stack into RAM, so it is for sizing the stacks,
+	 * not for production.
+	 */
+	bool paint_stack;
+	/**
+	 * Don't protect the stack with a guard page. Each guarded
+	 * stack takes 2 areas in the process memory map, and their
+	 * count is limited by vm.max_map_count, 65530 by default.
+	 * So more than ~30k coroutines need unguarded stacks.
+	 */
+	bool no_guard_page;
+	/** Scheduling policy. By default it is the scheduler's one. */
+	enum coro_sched_policy policy;
+	/** Priority for CORO_SCHED_PRIO, up to CORO_PRIO_MAX. */
+	int priority;
+	/** Weight for CORO_SCHED_FAIR. CORO_WEIGHT_DEFAULT by default. */
+	unsigned weight;
+	/**
+	 * Run on this shared stack instead of an own one. Pointers
+	 * to the coroutine's stack variables are valid only while
+	 * it is running, so they must not be given to the other
+	 * coroutines. Works only in single-threaded schedulers and
+	 * with the assembly context switch. Otherwise the coroutine
+	 * gets an own stack.
+	 */
+	struct coro_shared_stack *shared_stack;
+	/**
+	 * The coroutine is for coro_join(). When finished, it is not
+	 * put into the finished queue, so coro_sched_wait() never
+	 * returns it, and it can be joined at any time, even while
+	 * other threads wait in coro_sched_wait().
+	 */
+	bool joinable;
+};
+
+/**
+ * Create a new coroutine with options. @a opts can be NULL, then it
+ * is the same as coro_new().
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_opts *opts);
+
+/**
+ * Peak stack usage of the coroutine in bytes, 0 if it was not
+ * created with 'paint_stack' option. Can be called after the
+ * coroutine has finished, until it is deleted.
+ */
+size_t
+coro_stack_used(const struct coro *c);
+
+/**
+ * Wait until the coroutine has finished and return its status.
+ * Called from a coroutine, parks it. Called outside of coroutines,
+ * runs the coroutines of a single-threaded scheduler or blocks in
+ * M:N mode. The joined coroutine is not returned by
+ * coro_sched_wait(), the caller deletes it. A coroutine can be
+ * joined once, only within its scheduler.
+ *
+ * A coroutine, created without the 'joinable' option, can finish
+ * and be taken by coro_sched_wait() before the join. So in M:N
+ * mode it can be joined only if nothing waits in coro_sched_wait()
+ * meanwhile. Joinable coroutines have no such limit.
+ */
+int
+coro_join(struct coro *c);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -42,6 +265,256 @@ coro_is_finished(const struct coro *c);
 void
 coro_delete(struct coro *c);
 
+/** Coroutine stack pool statistics. */
+struct coro_stack_pool_stats {
+	/** Number of stacks owned by coroutines. */
+	size_t used;
+	/** Maximal number of stacks owned by coroutines at once. */
+	size_t used_peak;
+	/** Number of free stacks cached for reuse. */
+	size_t cached;
+	/** Bytes of used and cached stacks backed by RAM now. */
+	size_t resident;
+	/**
+	 * Maximal 'resident' value among the calls of this function.
+	 * The pages are faulted in by the running coroutines behind
+	 * the library's back, so it is a sampled peak, not the real
+	 * one. Call the function at the moments of interest.
+	 */
+	size_t resident_sampled_peak;
+};
+
+/**
+ * Get statistics of the stack pool. Stacks of deleted coroutines
+ * are cached and reused by new ones.
+ */
+void
+coro_stack_pool_stats(struct coro_stack_pool_stats *stats);
+
+/** Number of buckets in a histogram of durations. */
+#define CORO_HIST_BUCKETS 252
+
+/**
+ * Histogram of durations in nanoseconds. The buckets are
+ * log-linear: each power of 2 is split into 4 buckets, so a
+ * percentile is found with at most 25% error.
+ */
+struct coro_hist {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned long long buckets[CORO_HIST_BUCKETS];
+};
+
+/** Scheduling telemetry of a coroutine. */
+struct coro_telemetry {
+	/** How long the coroutine ran each time before a switch. */
+	struct coro_hist slice;
+	/** How long it was ready to run, but waited for its turn. */
+	struct coro_hist wait;
+	/** Cost of the context switches into the coroutine. */
+	struct coro_hist switch_cost;
+};
+
+/**
+ * Collect the telemetry of the coroutines created after this call.
+ * Each switch then reads the clock twice. Off by default, reset by
+ * coro_sched_init*().
+ */
+void
+coro_sched_telemetry(bool enable);
+
+/**
+ * Copy the telemetry of the coroutine. Returns false if it was not
+ * collected. Can be called by the coroutine itself, or after it has
+ * finished, until it is deleted.
+ */
+bool
+coro_telemetry(const struct coro *c, struct coro_telemetry *t);
+
+/**
+ * Duration in nanoseconds, which @a p part (from 0 to 1) of the
+ * histogram values do not exceed. 0 for an empty histogram.
+ */
+unsigned long long
+coro_hist_percentile(const struct coro_hist *h, double p);
+
+/**
+ * Write the telemetry as a JSON object: count, sum, p50, p99 and
+ * max of each histogram and its non-empty buckets as
+ * [lower bound, count] pairs.
+ */
+void
+coro_telemetry_dump(const struct coro_telemetry *t, FILE *out);
+
 /** Switch to another not finished coroutine. */
 void
 coro_yield(void);
+
+/**
+ * Coroutine I/O. The current coroutine is parked while the I/O is
+ * done by io_uring or by offload threads, and the other coroutines
+ * keep running. Outside of coroutines the functions just block.
+ * They return the same as the corresponding syscalls and set
+ * errno on error.
+ */
+
+/** Like open(2). */
+int
+coro_open(const char *path, int flags, mode_t mode);
+
+/** Like read(2). */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/** Like write(2). */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/**
+ * Synchronization primitives. A coroutine, blocked in them, is
+ * parked off the run queue until it is woken up. Blocking calls
+ * can be done only from coroutines, the others - from anywhere.
+ * The primitives work across threads in M:N mode.
+ */
+
+struct coro_mutex;
+
+struct coro_mutex *
+coro_mutex_new(void);
+
+void
+coro_mutex_delete(struct coro_mutex *m);
+
+/**
+ * Lock the mutex, wait if it is locked. The waiters get it in
+ * FIFO order.
+ */
+void
+coro_mutex_lock(struct coro_mutex *m);
+
+/** Lock the mutex, if it is not locked. Returns true on success. */
+bool
+coro_mutex_trylock(struct coro_mutex *m);
+
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+struct coro_cond;
+
+struct coro_cond *
+coro_cond_new(void);
+
+void
+coro_cond_delete(struct coro_cond *c);
+
+/**
+ * Unlock @a m, wait for a signal, lock @a m back. Spurious
+ * wakeups are possible only because of broadcast, as usual.
+ */
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m);
+
+/** Wake up one waiter, if any. */
+void
+coro_cond_signal(struct coro_cond *c);
+
+/** Wake up all waiters. */
+void
+coro_cond_broadcast(struct coro_cond *c);
+
+/** Bounded FIFO channel of pointers. */
+struct coro_chan;
+
+/** Create a channel for @a capacity messages, at least 1. */
+struct coro_chan *
+coro_chan_new(size_t capacity);
+
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Send a message, wait while the channel is full. Returns 0 on
+ * success, -1 if the channel is closed.
+ */
+int
+coro_chan_send(struct coro_chan *ch, void *msg);
+
+/**
+ * Receive a message, wait while the channel is empty. Returns 0 on
+ * success, -1 if the channel is closed and has no messages.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void **msg);
+
+/**
+ * Close the channel. The waiting senders fail, the receivers get
+ * the remaining messages and then fail.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
+
+/** Counter of unfinished jobs to wait for. */
+struct coro_wait_group;
+
+struct coro_wait_group *
+coro_wait_group_new(void);
+
+void
+coro_wait_group_delete(struct coro_wait_group *wg);
+
+/**
+ * Add @a count jobs, can be negative. The counter must not go below
+ * zero, that is a critical error, like more done() calls than jobs.
+ */
+void
+coro_wait_group_add(struct coro_wait_group *wg, long long count);
+
+/** Finish one job. */
+void
+coro_wait_group_done(struct coro_wait_group *wg);
+
+/** Wait until all the jobs are done. */
+void
+coro_wait_group_wait(struct coro_wait_group *wg);
+
+/**
+ * Generator - a coroutine, producing a stream of values (or
+ * batches of values) for a consumer coroutine. The producer runs
+ * up to two values ahead of the consumer: one is buffered, and one
+ * more is pending in a blocked coro_gen_yield().
+ */
+struct coro_gen;
+
+typedef int (*coro_gen_f)(struct coro_gen *, void *);
+
+/**
+ * Start a new coroutine, producing values with
+ * coro_gen_yield(). It is a usual coroutine, and is returned by
+ * coro_sched_wait() when finished.
+ */
+struct coro_gen *
+coro_gen_new(coro_gen_f func, void *func_arg);
+
+/**
+ * Stop consuming the values. The producer can still be running,
+ * then its next yield fails.
+ */
+void
+coro_gen_delete(struct coro_gen *gen);
+
+/**
+ * Pass a value to the consumer, wait while it has not taken the
+ * previous one. Returns 0 on success, -1 if the generator is
+ * deleted.
+ */
+int
+coro_gen_yield(struct coro_gen *gen, void *value);
+
+/**
+ * Get the next value, wait until it is produced. Returns 0 on
+ * success, -1 if the producer has finished and there are no
+ * values left.
+ */
+int
+coro_gen_next(struct coro_gen *gen, void **value);
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include "merge.h"
+
+#define MERGE_NODE_NONE UINT64_MAX
+
+/**
+ * Returns the node of the current number of the source, refilling
+ * it if necessary.
+ */
+static uint64_t merge_source_head(struct merge_tree *tree, int i) {
+  struct merge_source *source = &tree->sources[i];
+  while (source->pos == source->end) {
+    if (source->refill == NULL || !source->refill(source)) {
+      return MERGE_NODE_NONE;
+    }
+  }
+  uint32_t key = (uint32_t)*source->pos ^ 0x80000000;
+  return ((uint64_t)key << 32) | (uint32_t)i;
+}
+
+void merge_tree_create(
+  struct merge_tree *tree,
+  struct merge_source *sources,
+  int sources_count
+) {
+  int leaves_count = 1;
+  while (leaves_count < sources_count) {
+    leaves_count *= 2;
+  }
+  tree->leaves_count = leaves_count;
+  tree->sources = sources;
+  tree->sources_count = sources_count;
+  tree->nodes = malloc(sizeof(uint64_t) * leaves_count);
+
+  // Play all the matches bottom-up. The winners go up, the losers
+  // stay in the nodes.
+  uint64_t *winners = malloc(sizeof(uint64_t) * 2 * leaves_count);
+  for (int i = 0; i < leaves_count; ++i) {
+    winners[leaves_count + i] =
+      i < sources_count ? merge_source_head(tree, i) : MERGE_NODE_NONE;
+  }
+  for (int i = leaves_count - 1; i >= 1; --i) {
+    uint64_t a = winners[2 * i];
+    uint64_t b = winners[2 * i + 1];
+    winners[i] = a < b ? a : b;
+    tree->nodes[i] = a < b ? b : a;
+  }
+  tree->nodes[0] = winners[1];
+  free(winners);
+}
+
+void merge_tree_destroy(struct merge_tree *tree) {
+  free(tree->nodes);
+}
+
+size_t merge_tree_pop(struct merge_tree *tree, int *out, size_t size) {
+  uint64_t *nodes = tree->nodes;
+  int leaves_count = tree->leaves_count;
+  uint64_t winner = nodes[0];
+  size_t count = 0;
+  while (count < size && winner != MERGE_NODE_NONE) {
+    out[count++] = (int)((uint32_t)(winner >> 32) ^ 0x80000000);
+    int i = (int)(uint32_t)winner;
+    ++tree->sources[i].pos;
+    // The next number of the same source replays the matches of
+    // the previous winner on the way to the root.
+    uint64_t node = merge_source_head(tree, i);
+    for (int j = (leaves_count + i) / 2; j >= 1; j /= 2) {
+      uint64_t loser = nodes[j];
+      // Without branches, the outcome of a match is unpredictable.
+      nodes[j] = loser < node ? node : loser;
+      node = loser < node ? loser : node;
+    }
+    winner = node;
+  }
+  nodes[0] = winner;
+  return count;
+}
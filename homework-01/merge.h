@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Sorted sequence of numbers, merged by the merge tree. The numbers
+ * come in batches, [pos, end) is the current one.
+ */
+struct merge_source {
+  const int *pos;
+  const int *end;
+
+  /**
+   * Makes the next batch current. Returns false, when the source is
+   * over. NULL, if the only batch is given right away.
+   */
+  bool (*refill)(struct merge_source *source);
+
+  /**
+   * Context of the refill.
+   */
+  void *ctx;
+};
+
+/**
+ * Tournament tree of losers for the k-way merge. Each internal node
+ * keeps the loser of the match in its subtree, so taking the next
+ * number replays only the matches on the path from the winner's
+ * leaf to the root: log2(k) comparisons, and no comparisons of the
+ * sibling pairs, like in a binary heap.
+ *
+ * The nodes store the numbers themselves, together with the source
+ * indices, not pointers to the sources. The matches touch only the
+ * tree, which is a few KB even for a thousand sources, and each
+ * source is read once per its number, sequentially.
+ */
+struct merge_tree {
+  /**
+   * Number of the leaves, a power of 2.
+   */
+  int leaves_count;
+
+  /**
+   * nodes[0] is the winner, nodes[1 .. leaves_count - 1] are the
+   * losers. A node is a number with the sign bit flipped in the
+   * high half and the source index in the low half, so equal numbers
+   * are taken in the order of the sources. MERGE_NODE_NONE is an
+   * empty source.
+   */
+  uint64_t *nodes;
+
+  struct merge_source *sources;
+  int sources_count;
+};
+
+/**
+ * Builds the tree over the sources. They are read, but not copied.
+ */
+void merge_tree_create(
+  struct merge_tree *tree,
+  struct merge_source *sources,
+  int sources_count
+);
+
+void merge_tree_destroy(struct merge_tree *tree);
+
+/**
+ * Writes up to size next numbers into out. Returns their count, 0
+ * when all the sources are over.
+ */
+size_t merge_tree_pop(struct merge_tree *tree, int *out, size_t size);
@@ -0,0 +1,167 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "parser.h"
+
+static bool is_digit(char c) {
+  return (unsigned char)(c - '0') < 10;
+}
+
+static void number_array_push(struct number_array *array, int value) {
+  if (array->size == array->capacity) {
+    array->capacity = array->capacity == 0 ? 1024 : array->capacity * 2;
+    array->numbers = realloc(array->numbers, sizeof(int) * array->capacity);
+  }
+  array->numbers[array->size++] = value;
+}
+
+void number_array_reserve(struct number_array *array, size_t count) {
+  if (array->capacity - array->size >= count) {
+    return;
+  }
+  while (array->capacity - array->size < count) {
+    array->capacity = array->capacity == 0 ? 1024 : array->capacity * 2;
+  }
+  array->numbers = realloc(array->numbers, sizeof(int) * array->capacity);
+}
+
+/**
+ * Converts len digits at p into a number the plain way.
+ */
+static uint64_t parse_digits(const char *p, size_t len) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < len; ++i) {
+    value = value * 10 + (p[i] - '0');
+  }
+  return value;
+}
+
+#ifdef __SSE2__
+
+/**
+ * Returns a mask of the bytes among the 16 ones at p, which are
+ * equal to c.
+ */
+static unsigned char_mask(const char *p, char c) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+/**
+ * Returns a mask of the digits among the 16 bytes at p.
+ */
+static unsigned digit_mask(const char *p) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  v = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+  // Unsigned v <= 9 is the same as min(v, 9) == v.
+  __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(9)), v);
+  return _mm_movemask_epi8(is_digit);
+}
+
+/**
+ * Converts 1 to 8 digits at p into a number. 8 bytes at p must be
+ * readable. All the digits are converted at once inside a 64-bit
+ * word: pairs of digits, then quads, then the octet.
+ */
+static uint64_t parse_8_digits(const char *p, size_t len) {
+  uint64_t chunk;
+  memcpy(&chunk, p, sizeof(chunk));
+  // The first digit is in the lowest byte. Shift the bytes after
+  // the digits out, the leading ones become zero digits.
+  chunk <<= 8 * (8 - len);
+  chunk &= 0x0F0F0F0F0F0F0F0FULL;
+  chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FFULL;
+  chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFFULL;
+  chunk = (chunk * 10000 + (chunk >> 32)) & 0x00000000FFFFFFFFULL;
+  return chunk;
+}
+
+const char *parse_numbers(
+  const char *p,
+  const char *end,
+  bool is_last,
+  size_t limit,
+  struct number_array *array
+) {
+  while (p < end && array->size < limit) {
+    // Skip to the next number 16 bytes at a time.
+    unsigned starts = digit_mask(p) | char_mask(p, '-');
+    if (starts == 0) {
+      p += 16;
+      continue;
+    }
+    p += __builtin_ctz(starts);
+    if (p >= end) {
+      break;
+    }
+    const char *start = p;
+    bool is_negative = *p == '-';
+    p += is_negative;
+    // The mask has no bits above 16, so len is at most 16.
+    size_t len = __builtin_ctz(~digit_mask(p));
+    if (len == 16) {
+      // Too long for an int anyway, just consume it.
+      while (is_digit(p[len])) {
+        ++len;
+      }
+    } else if (p + len >= end && !is_last) {
+      return start;
+    }
+    if (len == 0) {
+      continue;
+    }
+    uint64_t value;
+    if (len <= 8) {
+      value = parse_8_digits(p, len);
+    } else {
+      value = parse_digits(p, len - 8) * 100000000 +
+              parse_8_digits(p + len - 8, 8);
+    }
+    p += len;
+    number_array_push(array, (int)(is_negative ? 0 - value : value));
+  }
+  return p < end ? p : end;
+}
+
+#else /* ! __SSE2__ */
+
+const char *parse_numbers(
+  const char *p,
+  const char *end,
+  bool is_last,
+  size_t limit,
+  struct number_array *array
+) {
+  while (p < end && array->size < limit) {
+    if (!is_digit(*p) && *p != '-') {
+      ++p;
+      continue;
+    }
+    const char *start = p;
+    bool is_negative = *p == '-';
+    p += is_negative;
+    size_t len = 0;
+    while (is_digit(p[len])) {
+      ++len;
+    }
+    if (p + len >= end && !is_last && len < 16) {
+      return start;
+    }
+    if (len == 0) {
+      continue;
+    }
+    uint64_t value = parse_digits(p, len);
+    p += len;
+    number_array_push(array, (int)(is_negative ? 0 - value : value));
+  }
+  return p;
+}
+
+#endif /* __SSE2__ */
+
+bool is_number_char(char c) {
+  return is_digit(c) || c == '-';
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The parser can read this many bytes past the end of the text.
+#define PARSE_PADDING 16
+
+/**
+ * Growable array of the numbers, parsed from a file.
+ */
+struct number_array {
+  int *numbers;
+  size_t size;
+  size_t capacity;
+};
+
+/**
+ * Makes room for count more numbers.
+ */
+void number_array_reserve(struct number_array *array, size_t count);
+
+/**
+ * Parses whitespace-separated numbers in [p, end) into the array,
+ * until it has limit numbers. PARSE_PADDING bytes after end must be
+ * readable, and, if is_last, must not be digits. Otherwise a number,
+ * touching the end, can continue past it and is left unparsed.
+ * Returns where the parsing has stopped.
+ */
+const char *parse_numbers(
+  const char *p,
+  const char *end,
+  bool is_last,
+  size_t limit,
+  struct number_array *array
+);
+
+/**
+ * Tells if the character can be a part of a number: a digit or a
+ * minus.
+ */
+bool is_number_char(char c);
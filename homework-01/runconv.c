@@ -0,0 +1,121 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "parser.h"
+#include "runfile.h"
+#include "writer.h"
+
+/**
+ * Converter of the numbers between text files, as the sorter reads
+ * and writes them, and binary run files. A sorted run file is taken
+ * by the sorter without parsing and sorting.
+ */
+
+#define READ_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * Reads the numbers of the text file with the parser of the sorter.
+ * Returns -1 on error.
+ */
+static int read_text(const char *filename, struct number_array *array) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  char *buffer = malloc(READ_BUFFER_SIZE + PARSE_PADDING);
+  // A number cut by the buffer end is moved to the buffer start.
+  size_t carry = 0;
+  int rc = 0;
+  while (true) {
+    ssize_t size = read(fd, buffer + carry, READ_BUFFER_SIZE - carry);
+    if (size < 0) {
+      rc = -1;
+      break;
+    }
+    bool is_last = size == 0;
+    const char *end = buffer + carry + size;
+    memset(buffer + carry + size, 0, PARSE_PADDING);
+    const char *p = parse_numbers(buffer, end, is_last, SIZE_MAX, array);
+    if (is_last) {
+      break;
+    }
+    carry = end - p;
+    memmove(buffer, p, carry);
+  }
+  free(buffer);
+  close(fd);
+  return rc;
+}
+
+static int text_to_run(const char *text_filename, const char *run_filename) {
+  struct number_array array = {NULL, 0, 0};
+  if (read_text(text_filename, &array) != 0) {
+    fprintf(stderr, "Failed to read %s\n", text_filename);
+    free(array.numbers);
+    return 1;
+  }
+  int *numbers = array.numbers;
+  size_t count = array.size;
+  bool is_sorted = true;
+  for (size_t i = 1; i < count && is_sorted; ++i) {
+    is_sorted = numbers[i - 1] <= numbers[i];
+  }
+  struct run_file file;
+  if (run_file_create(&file, run_filename, count, is_sorted) != 0) {
+    fprintf(stderr, "Failed to create %s\n", run_filename);
+    free(numbers);
+    return 1;
+  }
+  if (count > 0) {
+    memcpy(file.numbers, numbers, sizeof(int) * count);
+  }
+  free(numbers);
+  if (run_file_close(&file) != 0) {
+    fprintf(stderr, "Failed to write %s\n", run_filename);
+    return 1;
+  }
+  printf("%zu numbers, %s\n", count, is_sorted ? "sorted" : "not sorted");
+  return 0;
+}
+
+static int run_to_text(const char *run_filename, const char *text_filename) {
+  struct run_file file;
+  if (run_file_open(&file, run_filename) != 0) {
+    fprintf(stderr, "Failed to read %s\n", run_filename);
+    return 1;
+  }
+  struct number_writer writer;
+  if (number_writer_open(&writer, text_filename, NUMBER_WRITER_BUFFER_SIZE) != 0) {
+    fprintf(stderr, "Failed to open %s\n", text_filename);
+    run_file_close(&file);
+    return 1;
+  }
+  number_writer_write(&writer, file.numbers, file.count);
+  run_file_close(&file);
+  if (number_writer_close(&writer) != 0) {
+    fprintf(stderr, "Failed to write %s\n", text_filename);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 4 && strcmp(argv[1], "-b") == 0) {
+    return text_to_run(argv[2], argv[3]);
+  }
+  if (argc == 4 && strcmp(argv[1], "-t") == 0) {
+    return run_to_text(argv[2], argv[3]);
+  }
+  printf(
+    "Usage: %s -b <text file> <run file>\n"
+    "       %s -t <run file> <text file>\n"
+    "  -b  text to a binary run file, marked sorted if it is\n"
+    "  -t  binary run file to text\n",
+    argv[0],
+    argv[0]
+  );
+  return 1;
+}
@@ -0,0 +1,104 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "runfile.h"
+
+bool run_file_is_run(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  char magic[sizeof(RUN_FILE_MAGIC) - 1];
+  bool is_run = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+    memcmp(magic, RUN_FILE_MAGIC, sizeof(magic)) == 0;
+  close(fd);
+  return is_run;
+}
+
+int run_file_open(struct run_file *file, const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct run_file_header)) {
+    close(fd);
+    return -1;
+  }
+  // Private writable pages, so the numbers can be swapped in place
+  // without touching the file.
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  struct run_file_header *header = map;
+  bool is_swapped = header->byte_order == __builtin_bswap32(RUN_FILE_BYTE_ORDER);
+  uint64_t count = is_swapped ? __builtin_bswap64(header->count) : header->count;
+  uint32_t flags = is_swapped ? __builtin_bswap32(header->flags) : header->flags;
+  if (memcmp(header->magic, RUN_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+      (header->byte_order != RUN_FILE_BYTE_ORDER && !is_swapped) ||
+      count > (st.st_size - sizeof(struct run_file_header)) / sizeof(int)) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+  file->numbers = (int *)(header + 1);
+  file->count = count;
+  file->is_sorted = (flags & RUN_FILE_SORTED) != 0;
+  file->map = map;
+  file->map_size = st.st_size;
+  file->is_created = false;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  if (is_swapped) {
+    for (size_t i = 0; i < count; ++i) {
+      file->numbers[i] = (int)__builtin_bswap32((uint32_t)file->numbers[i]);
+    }
+  }
+  return 0;
+}
+
+int run_file_create(
+  struct run_file *file,
+  const char *filename,
+  size_t count,
+  bool is_sorted
+) {
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  size_t size = sizeof(struct run_file_header) + sizeof(int) * count;
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  struct run_file_header *header = map;
+  memcpy(header->magic, RUN_FILE_MAGIC, sizeof(header->magic));
+  header->byte_order = RUN_FILE_BYTE_ORDER;
+  header->flags = is_sorted ? RUN_FILE_SORTED : 0;
+  header->count = count;
+  file->numbers = (int *)(header + 1);
+  file->count = count;
+  file->is_sorted = is_sorted;
+  file->map = map;
+  file->map_size = size;
+  file->is_created = true;
+  return 0;
+}
+
+int run_file_close(struct run_file *file) {
+  // Errors of the writeback, like ENOSPC, are reported only here.
+  bool is_synced = !file->is_created ||
+    msync(file->map, file->map_size, MS_SYNC) == 0;
+  if (munmap(file->map, file->map_size) != 0 || !is_synced) {
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Binary file of int32 numbers: a header, then the numbers as they
+ * are in memory. Such a file is read and written through mmap()
+ * without any parsing.
+ */
+
+#define RUN_FILE_MAGIC "INT32RUN"
+// Written in the byte order of the writer, so the reader knows if
+// the numbers have to be swapped.
+#define RUN_FILE_BYTE_ORDER 0x01020304
+// The numbers are sorted in ascending order.
+#define RUN_FILE_SORTED 0x1
+
+struct run_file_header {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t flags;
+  uint64_t count;
+};
+
+/**
+ * Mapped run file.
+ */
+struct run_file {
+  /**
+   * Numbers in the native byte order. Writable only, if the file is
+   * created.
+   */
+  int *numbers;
+  size_t count;
+  bool is_sorted;
+
+  void *map;
+  size_t map_size;
+  /**
+   * True, if the file is created, and its pages are written back on
+   * close.
+   */
+  bool is_created;
+};
+
+/**
+ * Tells if the file starts with the run file magic.
+ */
+bool run_file_is_run(const char *filename);
+
+/**
+ * Maps the file for reading. Numbers in the foreign byte order are
+ * swapped in a private copy of the pages. Returns -1 on error or if
+ * the file is not a run file.
+ */
+int run_file_open(struct run_file *file, const char *filename);
+
+/**
+ * Creates the file of count numbers and maps it for writing. The
+ * numbers are to be filled before run_file_close(). Returns -1 on
+ * error.
+ */
+int run_file_create(
+  struct run_file *file,
+  const char *filename,
+  size_t count,
+  bool is_sorted
+);
+
+/**
+ * Unmaps the file. The numbers of a created one are synced to the
+ * file first, so a failed writeback is not lost. Returns -1 on
+ * error.
+ */
+int run_file_close(struct run_file *file);
@@ -3,11 +3,77 @@
 #include <string.h>
 #include <time.h>
 #include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SORT_NETWORK_AVX2 1
+#else
+#define SORT_NETWORK_AVX2 0
+#endif
 #include "libcoro.h"
+#include "merge.h"
+#include "parser.h"
+#include "runfile.h"
+#include "thread_pool.h"
+#include "writer.h"
 
 #define DEFAULT_TARGET_LATENCY 1000
 #define DEFAULT_COROUTINES 3
+#define DEFAULT_WORKERS 0
 #define OUTPUT_FILE "output.txt"
+// Files are sorted in chunks of that many bytes, so a big file is
+// shared by all the coroutines.
+#define DEFAULT_CHUNK_SIZE (64 * 1024 * 1024)
+#define READ_CHUNK_SIZE (1024 * 1024)
+// Text is parsed in slices of this size between the yield checks.
+#define PARSE_SLICE_SIZE (16 * 1024)
+// Yield checks read the clock, so the sort loops do them once per
+// this many steps. A power of 2.
+#define YIELD_CHECK_STEPS 1024
+// The inner loops read the clock about that many times per quantum.
+// The quantum is overrun by at most its fraction.
+#define YIELD_CHECKS_PER_QUANTUM 16
+// The cost of a sift step is measured on a heap sort of that many
+// numbers at startup.
+#define YIELD_CALIBRATION_SIZE (16 * 1024)
+// Partitions of pdqsort smaller than that are insertion sorted.
+#define PDQ_INSERTION_SORT_THRESHOLD 24
+// Partitions of pdqsort bigger than that take the pivot as a
+// median of 3 medians of 3.
+#define PDQ_NINTHER_THRESHOLD 128
+// An insertion sort of a partition with more moves gives up.
+#define PDQ_PARTIAL_INSERTION_SORT_LIMIT 8
+// Sorting networks sort up to that many numbers at once.
+#define SORT_NETWORK_MAX 64
+// Number of values, sampled for the automatic choice of the sort.
+#define SORT_SAMPLE_SIZE 64
+// Radix sort pays off on at least that many numbers per pass.
+#define RADIX_MIN_SIZE_PER_PASS 1024
+// Runs on the merge stack have distinct levels, so there are at
+// most log2(files count) + 1 of them.
+#define MERGE_STACK_SIZE 64
+// Merged numbers are taken from the merge tree in batches of that
+// many.
+#define MERGE_OUTPUT_BATCH 4096
+// The merging coroutine passes the merged numbers to the output
+// coroutine in batches of that many, with that many batches in
+// flight.
+#define OUTPUT_BATCH_SIZE (64 * 1024)
+#define OUTPUT_PIPELINE_DEPTH 4
+// In the external mode the buffers of the reads and the writes of
+// the runs take 1/64 of the memory budget, within these bounds.
+#define EXTERNAL_IO_BUFFER_MIN (4 * 1024)
+#define EXTERNAL_IO_BUFFER_MAX (1024 * 1024)
+// Runs of fewer numbers would make too many files.
+#define EXTERNAL_RUN_SIZE_MIN 1024
+#define EXTERNAL_FAN_IN_MAX 1024
+// Each thread of the parallel merge writes the output through a
+// buffer of that size.
+#define PARALLEL_WRITER_BUFFER_SIZE (256 * 1024)
 
 /**
  * Context of a coroutine.
@@ -28,189 +94,2131 @@ struct coro_context {
    */
   long long total_switch_count;
 
+  /**
+   * Scheduling telemetry, if collected.
+   */
+  struct coro_telemetry telemetry;
+  bool has_telemetry;
+
   /**
    * Data required by the coroutine to do its work.
    */
   int files_count;
   char **filenames_to_sort;
-  int *file_to_sort_idx;
-  int **sorted_arrays;
-  size_t *sorted_arrays_sizes;
+  /**
+   * Chunks of the files to sort, struct file_chunk. Coroutines take
+   * them until the channel is closed and empty.
+   */
+  struct coro_chan *files_to_sort;
+  /**
+   * Channel of the sorted runs to the merging coroutine, shared by
+   * all the sorting coroutines. NULL is sent after the last run.
+   */
+  struct coro_chan *sorted_runs;
+  long long coroutine_quantum;
+  bool is_preemptive;
+  /**
+   * Steps of the inner loops between the clock reads, calibrated
+   * for the quantum.
+   */
+  long long yield_check_steps;
+  /**
+   * Sort kernel of the files. NULL, if it is chosen per file.
+   */
+  const struct sort_kernel *sort_kernel;
+
+  /**
+   * External mode: numbers of all the files go into runs of that
+   * many numbers, which are sorted and spilled to temporary files.
+   * 0 means each file is sorted in memory as a whole.
+   */
+  size_t run_size;
+  size_t io_buffer_size;
+
+  /**
+   * Parallel mode: the files are sorted by the thread pool, while
+   * the coroutine reads the next ones. NULL, if the coroutine sorts
+   * them itself.
+   */
+  struct thread_pool *pool;
+};
+
+/**
+ * Sorted array, produced by a sorting coroutine or by merging two
+ * such arrays.
+ */
+struct sorted_run {
+  int *numbers;
+  size_t size;
+
+  /**
+   * Temporary file of the run in the external mode, then numbers is
+   * NULL. -1, if the run is in memory.
+   */
+  int fd;
+
+  /**
+   * Sorting of the numbers on the thread pool in the parallel mode.
+   * They can be read only after the task is joined. NULL, if the
+   * numbers are sorted already.
+   */
+  struct thread_task *task;
+
+  /**
+   * Number of merges this run has passed. Runs of the same level
+   * are merged, like in a binary counter, so each number is moved
+   * O(log(files count)) times.
+   */
+  int level;
+};
+
+/**
+ * Context of the merging coroutine.
+ */
+struct merge_context {
+  char *name;
+  long long total_work_time;
+  long long total_switch_count;
+  struct coro_telemetry telemetry;
+  bool has_telemetry;
+
+  /**
+   * Sorted runs of all the sorting coroutines, in the order they are
+   * done. Each sorter sends NULL after its last run.
+   */
+  struct coro_chan *sorted_runs;
+  int sorters_count;
+
+  /**
+   * Output file, which the coroutine merges the runs into as soon as
+   * the last one is sorted. Not used in the parallel mode.
+   */
+  const char *output_filename;
+  bool is_binary_output;
+  size_t output_buffer_size;
+  size_t output_batch_size;
+
+  /**
+   * Error of the output, NULL on success.
+   */
+  const char *output_error;
+
+  /**
+   * Work time, switches and telemetry of the output coroutine.
+   */
+  long long output_work_time;
+  long long output_switch_count;
+  struct coro_telemetry output_telemetry;
+  bool has_output_telemetry;
+
+  /**
+   * External mode: fan_in spilled runs of the same level are merged
+   * into one while the files are still being sorted. In the end the
+   * runs are merged down to final_fan_in, which main() merges into
+   * the output file. fan_in is 0 in the in-memory mode.
+   */
+  int fan_in;
+  int final_fan_in;
+  size_t io_buffer_size;
+
+  /**
+   * If true, the runs are being sorted by the thread pool. They are
+   * not merged by the coroutine, but are all merged in parallel by
+   * main().
+   */
+  bool is_parallel;
+
+  /**
+   * Runs for main() to merge in the external and the parallel
+   * modes.
+   */
+  struct sorted_run **runs;
+  int runs_count;
+  int runs_capacity;
+
+  long long coroutine_quantum;
+  bool is_preemptive;
+  /**
+   * Merge steps between the clock reads. The sorters' period,
+   * calibrated on the sift steps, is reused as is.
+   */
+  long long yield_check_steps;
+};
+
+/**
+ * Measures work time of a coroutine and yields when its quantum is
+ * over.
+ */
+struct work_timer {
+  /**
+   * Total time spent by the coroutine on work.
+   */
+  long long total_work_time;
+
+  /**
+   * When the current work slice has started.
+   */
+  long long last_start;
+
+  /**
+   * Time slice of the coroutine.
+   */
+  long long quantum;
+
+  /**
+   * If true, the end of the slice is signaled by the libcoro
+   * preemption timer, and the clock is not read on each check.
+   */
+  bool is_preemptive;
+
+  /**
+   * yield_check_step() reads the clock once per that many steps. 0
+   * means each step.
+   */
+  long long check_steps;
+  long long steps_left;
+};
+
+/**
+ * Returns the current monotonic time in microseconds.
+ */
+static long long get_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void work_timer_start(struct work_timer *timer) {
+  timer->last_start = get_now();
+}
+
+static void work_timer_stop(struct work_timer *timer) {
+  timer->total_work_time += get_now() - timer->last_start;
+}
+
+static void yield_if_necessary_record_work_time(struct work_timer *timer) {
+  if (timer->is_preemptive) {
+    if (coro_preempt_is_requested()) {
+      work_timer_stop(timer);
+      coro_yield();
+      work_timer_start(timer);
+    }
+    return;
+  }
+  long long work_time = get_now() - timer->last_start;
+  if (work_time > timer->quantum) {
+    timer->total_work_time += work_time;
+    coro_yield();
+    work_timer_start(timer);
+  }
+}
+
+/**
+ * Yield check for the steps of the inner loops, which are too short
+ * to read the clock on each of them.
+ */
+static inline void yield_check_step(struct work_timer *timer) {
+  if (--timer->steps_left > 0) {
+    return;
+  }
+  timer->steps_left = timer->check_steps;
+  yield_if_necessary_record_work_time(timer);
+}
+
+static void heap_sort(
+  int *array,
+  size_t array_size,
+  struct work_timer *timer
+) {
+  int size = (int)array_size;
+  for (int i = size / 2 - 1; i >= 0; --i) {
+    int j = i;
+    while (true) {
+      int left = 2 * j + 1;
+      int right = 2 * j + 2;
+      int largest = j;
+      if (left < size && array[left] > array[largest]) {
+        largest = left;
+      }
+      if (right < size && array[right] > array[largest]) {
+        largest = right;
+      }
+      if (largest == j) {
+        break;
+      }
+      int tmp = array[j];
+      array[j] = array[largest];
+      array[largest] = tmp;
+      j = largest;
+
+      yield_check_step(timer);
+    }
+  }
+  for (int i = size - 1; i > 0; --i) {
+    int tmp1 = array[0];
+    array[0] = array[i];
+    array[i] = tmp1;
+    int j = 0;
+    while (true) {
+      int left = 2 * j + 1;
+      int right = 2 * j + 2;
+      int largest = j;
+      if (left < i && array[left] > array[largest]) {
+        largest = left;
+      }
+      if (right < i && array[right] > array[largest]) {
+        largest = right;
+      }
+      if (largest == j) {
+        break;
+      }
+      int tmp2 = array[j];
+      array[j] = array[largest];
+      array[largest] = tmp2;
+      j = largest;
+
+      yield_check_step(timer);
+    }
+  }
+}
+
+/**
+ * Measures a heap sort and returns how many of its sift steps take
+ * 1/YIELD_CHECKS_PER_QUANTUM of the quantum, so yield_check_step()
+ * reads the clock about as often as the quantum needs.
+ */
+static long long calibrate_check_steps(long long quantum) {
+  int *numbers = malloc(sizeof(int) * YIELD_CALIBRATION_SIZE);
+  unsigned seed = 1;
+  for (int i = 0; i < YIELD_CALIBRATION_SIZE; ++i) {
+    seed = seed * 1103515245 + 12345;
+    numbers[i] = (int)seed;
+  }
+  // The steps are counted down from the check period, which is never
+  // reached.
+  struct work_timer timer = {
+    .total_work_time = 0,
+    .quantum = LLONG_MAX,
+    .is_preemptive = false,
+    .check_steps = LLONG_MAX,
+    .steps_left = LLONG_MAX,
+  };
+  long long start = get_now();
+  heap_sort(numbers, YIELD_CALIBRATION_SIZE, &timer);
+  long long elapsed = get_now() - start;
+  free(numbers);
+  long long steps = LLONG_MAX - timer.steps_left;
+  if (elapsed < 1) {
+    elapsed = 1;
+  }
+  long long check_steps = quantum * steps / YIELD_CHECKS_PER_QUANTUM / elapsed;
+  return check_steps > 1 ? check_steps : 1;
+}
+
+static void swap_ints(int *a, int *b) {
+  int tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static void sort2(int *a, int *b) {
+  if (*b < *a) {
+    swap_ints(a, b);
+  }
+}
+
+static void sort3(int *a, int *b, int *c) {
+  sort2(a, b);
+  sort2(b, c);
+  sort2(a, b);
+}
+
+static void insertion_sort(int *begin, int *end) {
+  for (int *cur = begin + 1; cur < end; ++cur) {
+    int tmp = *cur;
+    int *sift = cur;
+    while (sift != begin && tmp < sift[-1]) {
+      *sift = sift[-1];
+      --sift;
+    }
+    *sift = tmp;
+  }
+}
+
+/**
+ * Insertion sort of a range, which has an element not greater
+ * than all of it right before the begin.
+ */
+static void unguarded_insertion_sort(int *begin, int *end) {
+  for (int *cur = begin + 1; cur < end; ++cur) {
+    int tmp = *cur;
+    int *sift = cur;
+    while (tmp < sift[-1]) {
+      *sift = sift[-1];
+      --sift;
+    }
+    *sift = tmp;
+  }
+}
+
+#if SORT_NETWORK_AVX2
+
+#define AVX2 __attribute__((target("avx2")))
+
+/**
+ * Compare-exchange of the 8 lanes of v with the partner lanes in t.
+ * The lanes in the mask take the max, the others take the min.
+ */
+#define NETWORK_STEP(v, t, mask) \
+  _mm256_blend_epi32(_mm256_min_epi32(v, t), _mm256_max_epi32(v, t), mask)
+
+static inline AVX2 __m256i swap_lanes_1(__m256i v) {
+  return _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+static inline AVX2 __m256i swap_lanes_2(__m256i v) {
+  return _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+static inline AVX2 __m256i swap_lanes_4(__m256i v) {
+  return _mm256_permute2x128_si256(v, v, 1);
+}
+
+static inline AVX2 __m256i reverse_lanes(__m256i v) {
+  return _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+/**
+ * Bitonic sort of the 8 lanes: sorts pairs in alternating
+ * directions, then quads, then the whole register.
+ */
+static inline AVX2 __m256i sort_8_lanes(__m256i v) {
+  v = NETWORK_STEP(v, swap_lanes_1(v), 0x66);
+  v = NETWORK_STEP(v, swap_lanes_2(v), 0x3C);
+  v = NETWORK_STEP(v, swap_lanes_1(v), 0x5A);
+  v = NETWORK_STEP(v, swap_lanes_4(v), 0xF0);
+  v = NETWORK_STEP(v, swap_lanes_2(v), 0xCC);
+  v = NETWORK_STEP(v, swap_lanes_1(v), 0xAA);
+  return v;
+}
+
+/**
+ * Sorts the 8 lanes, which hold a bitonic sequence.
+ */
+static inline AVX2 __m256i clean_8_lanes(__m256i v) {
+  v = NETWORK_STEP(v, swap_lanes_4(v), 0xF0);
+  v = NETWORK_STEP(v, swap_lanes_2(v), 0xCC);
+  v = NETWORK_STEP(v, swap_lanes_1(v), 0xAA);
+  return v;
+}
+
+/**
+ * Sorts a bitonic sequence in count registers.
+ */
+static inline AVX2 void clean_registers(__m256i *v, int count) {
+  for (int distance = count / 2; distance > 0; distance /= 2) {
+    for (int i = 0; i < count; ++i) {
+      if ((i & distance) == 0) {
+        __m256i min = _mm256_min_epi32(v[i], v[i + distance]);
+        v[i + distance] = _mm256_max_epi32(v[i], v[i + distance]);
+        v[i] = min;
+      }
+    }
+  }
+  for (int i = 0; i < count; ++i) {
+    v[i] = clean_8_lanes(v[i]);
+  }
+}
+
+/**
+ * Sorts count registers of numbers, count is a power of 2. Each
+ * register is sorted on its own, then the sorted runs are merged
+ * pairwise: the second run is reversed, so the mins and the maxes
+ * of the two runs are bitonic sequences, and all the mins go first.
+ */
+static AVX2 void sort_registers(__m256i *v, int count) {
+  for (int i = 0; i < count; ++i) {
+    v[i] = sort_8_lanes(v[i]);
+  }
+  for (int run = 1; run < count; run *= 2) {
+    for (__m256i *a = v; a < v + count; a += 2 * run) {
+      __m256i *b = a + run;
+      __m256i reversed[SORT_NETWORK_MAX / 8];
+      for (int i = 0; i < run; ++i) {
+        reversed[i] = reverse_lanes(b[run - 1 - i]);
+      }
+      for (int i = 0; i < run; ++i) {
+        b[i] = _mm256_max_epi32(a[i], reversed[i]);
+        a[i] = _mm256_min_epi32(a[i], reversed[i]);
+      }
+      clean_registers(a, run);
+      clean_registers(b, run);
+    }
+  }
+}
+
+/**
+ * Sorts up to SORT_NETWORK_MAX numbers with AVX2 sorting networks.
+ * The numbers are padded with INT_MAX to fill 1, 2, 4 or 8
+ * registers.
+ */
+static AVX2 void network_sort_avx2(int *begin, int *end) {
+  size_t size = end - begin;
+  // An empty range may come with NULL pointers, which memcpy() must
+  // not get.
+  if (size < 2) {
+    return;
+  }
+  int count = 1;
+  while ((size_t)count * 8 < size) {
+    count *= 2;
+  }
+  int buffer[SORT_NETWORK_MAX];
+  memcpy(buffer, begin, sizeof(int) * size);
+  for (size_t i = size; i < (size_t)count * 8; ++i) {
+    buffer[i] = INT_MAX;
+  }
+  __m256i v[SORT_NETWORK_MAX / 8];
+  for (int i = 0; i < count; ++i) {
+    v[i] = _mm256_loadu_si256((const __m256i *)(buffer + 8 * i));
+  }
+  sort_registers(v, count);
+  for (int i = 0; i < count; ++i) {
+    _mm256_storeu_si256((__m256i *)(buffer + 8 * i), v[i]);
+  }
+  memcpy(begin, buffer, sizeof(int) * size);
+}
+
+#endif /* SORT_NETWORK_AVX2 */
+
+/**
+ * Sort of the small partitions.
+ */
+struct small_sort {
+  /**
+   * NULL, if the insertion sorts are used.
+   */
+  void (*sort)(int *begin, int *end);
+  size_t max_size;
+};
+
+/**
+ * Returns the best sort of the small partitions for the CPU.
+ */
+static struct small_sort small_sort_for_cpu(void) {
+  struct small_sort small = {NULL, PDQ_INSERTION_SORT_THRESHOLD - 1};
+#if SORT_NETWORK_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    small.sort = network_sort_avx2;
+    small.max_size = SORT_NETWORK_MAX;
+  }
+#endif
+  return small;
+}
+
+/**
+ * Insertion sort, which gives up after a few moves. Returns true,
+ * if the range is sorted.
+ */
+static bool partial_insertion_sort(int *begin, int *end) {
+  size_t moves = 0;
+  for (int *cur = begin + 1; cur < end; ++cur) {
+    int tmp = *cur;
+    int *sift = cur;
+    if (tmp < sift[-1]) {
+      do {
+        *sift = sift[-1];
+        --sift;
+      } while (sift != begin && tmp < sift[-1]);
+      *sift = tmp;
+      moves += cur - sift;
+    }
+    if (moves > PDQ_PARTIAL_INSERTION_SORT_LIMIT) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Partitions the range around the pivot at begin into the elements
+ * less than it and the rest. Returns the final pivot position.
+ * already_partitioned is set, if no elements were moved.
+ */
+static int *partition_right(
+  int *begin,
+  int *end,
+  bool *already_partitioned,
+  struct work_timer *timer
+) {
+  int pivot = *begin;
+  int *first = begin;
+  int *last = end;
+  // The median of 3 guarantees a guard on both sides.
+  while (*++first < pivot);
+  if (first - 1 == begin) {
+    while (first < last && !(*--last < pivot));
+  } else {
+    while (!(*--last < pivot));
+  }
+  *already_partitioned = first >= last;
+  long long next_check = YIELD_CHECK_STEPS;
+  while (first < last) {
+    swap_ints(first, last);
+    while (*++first < pivot);
+    while (!(*--last < pivot));
+    if ((first - begin) + (end - last) > next_check) {
+      next_check += YIELD_CHECK_STEPS;
+      yield_if_necessary_record_work_time(timer);
+    }
+  }
+  int *pivot_pos = first - 1;
+  *begin = *pivot_pos;
+  *pivot_pos = pivot;
+  return pivot_pos;
+}
+
+/**
+ * Partitions the range around the pivot at begin into the elements
+ * equal to it and the greater ones. Used when the pivot is equal to
+ * the element before the range. Returns the last equal element.
+ */
+static int *partition_left(int *begin, int *end, struct work_timer *timer) {
+  int pivot = *begin;
+  int *first = begin;
+  int *last = end;
+  while (pivot < *--last);
+  if (last + 1 == end) {
+    while (first < last && !(pivot < *++first));
+  } else {
+    while (!(pivot < *++first));
+  }
+  long long next_check = YIELD_CHECK_STEPS;
+  while (first < last) {
+    swap_ints(first, last);
+    while (pivot < *--last);
+    while (!(pivot < *++first));
+    if ((first - begin) + (end - last) > next_check) {
+      next_check += YIELD_CHECK_STEPS;
+      yield_if_necessary_record_work_time(timer);
+    }
+  }
+  int *pivot_pos = last;
+  *begin = *pivot_pos;
+  *pivot_pos = pivot;
+  return pivot_pos;
+}
+
+/**
+ * Pattern-defeating quicksort of the range. leftmost is false, if
+ * there is an element not greater than all of the range right
+ * before it. After bad_allowed highly unbalanced partitions it
+ * falls back to the heap sort.
+ */
+static void pdq_sort_loop(
+  int *begin,
+  int *end,
+  int bad_allowed,
+  bool leftmost,
+  const struct small_sort *small,
+  struct work_timer *timer
+) {
+  while (true) {
+    size_t size = end - begin;
+    if (size <= small->max_size) {
+      if (small->sort != NULL) {
+        small->sort(begin, end);
+      } else if (leftmost) {
+        insertion_sort(begin, end);
+      } else {
+        unguarded_insertion_sort(begin, end);
+      }
+      return;
+    }
+
+    // Put the pivot to the begin.
+    size_t half = size / 2;
+    if (size > PDQ_NINTHER_THRESHOLD) {
+      sort3(begin, begin + half, end - 1);
+      sort3(begin + 1, begin + (half - 1), end - 2);
+      sort3(begin + 2, begin + (half + 1), end - 3);
+      sort3(begin + (half - 1), begin + half, begin + (half + 1));
+      swap_ints(begin, begin + half);
+    } else {
+      sort3(begin + half, begin, end - 1);
+    }
+
+    // Many equal elements: the ones equal to the pivot, which is
+    // equal to the element before the range, are in place.
+    if (!leftmost && !(begin[-1] < *begin)) {
+      begin = partition_left(begin, end, timer) + 1;
+      continue;
+    }
+
+    bool already_partitioned;
+    int *pivot_pos = partition_right(begin, end, &already_partitioned, timer);
+    yield_if_necessary_record_work_time(timer);
+    size_t left_size = pivot_pos - begin;
+    size_t right_size = end - (pivot_pos + 1);
+    if (left_size < size / 8 || right_size < size / 8) {
+      // A bad pivot, break the patterns in the input.
+      if (--bad_allowed == 0) {
+        heap_sort(begin, size, timer);
+        return;
+      }
+      if (left_size >= PDQ_INSERTION_SORT_THRESHOLD) {
+        swap_ints(begin, begin + left_size / 4);
+        swap_ints(pivot_pos - 1, pivot_pos - left_size / 4);
+        if (left_size > PDQ_NINTHER_THRESHOLD) {
+          swap_ints(begin + 1, begin + (left_size / 4 + 1));
+          swap_ints(begin + 2, begin + (left_size / 4 + 2));
+          swap_ints(pivot_pos - 2, pivot_pos - (left_size / 4 + 1));
+          swap_ints(pivot_pos - 3, pivot_pos - (left_size / 4 + 2));
+        }
+      }
+      if (right_size >= PDQ_INSERTION_SORT_THRESHOLD) {
+        swap_ints(pivot_pos + 1, pivot_pos + (1 + right_size / 4));
+        swap_ints(end - 1, end - right_size / 4);
+        if (right_size > PDQ_NINTHER_THRESHOLD) {
+          swap_ints(pivot_pos + 2, pivot_pos + (2 + right_size / 4));
+          swap_ints(pivot_pos + 3, pivot_pos + (3 + right_size / 4));
+          swap_ints(end - 2, end - (1 + right_size / 4));
+          swap_ints(end - 3, end - (2 + right_size / 4));
+        }
+      }
+    } else if (already_partitioned &&
+               partial_insertion_sort(begin, pivot_pos) &&
+               partial_insertion_sort(pivot_pos + 1, end)) {
+      // Presorted input is sorted in linear time.
+      return;
+    }
+
+    // Recurse into the left part, loop over the right one.
+    pdq_sort_loop(begin, pivot_pos, bad_allowed, leftmost, small, timer);
+    begin = pivot_pos + 1;
+    leftmost = false;
+  }
+}
+
+static void pdq_sort(int *array, size_t size, struct work_timer *timer) {
+  int log2_size = 0;
+  while ((size >> log2_size) > 1) {
+    ++log2_size;
+  }
+  struct small_sort small = small_sort_for_cpu();
+  pdq_sort_loop(array, array + size, log2_size, true, &small, timer);
+}
+
+/**
+ * LSD radix sort by bytes. The sign bit is flipped to order the
+ * numbers as unsigned. Bytes, equal in all the numbers, are
+ * skipped.
+ */
+static void radix_sort(int *array, size_t size, struct work_timer *timer) {
+  if (size < 2) {
+    return;
+  }
+  uint32_t *keys = (uint32_t *)array;
+  size_t counts[4][256];
+  memset(counts, 0, sizeof(counts));
+  for (size_t i = 0; i < size; ++i) {
+    uint32_t key = keys[i] ^ 0x80000000;
+    keys[i] = key;
+    for (int d = 0; d < 4; ++d) {
+      ++counts[d][(key >> (8 * d)) & 0xFF];
+    }
+    if ((i & (YIELD_CHECK_STEPS - 1)) == 0) {
+      yield_if_necessary_record_work_time(timer);
+    }
+  }
+
+  uint32_t *buffer = malloc(sizeof(uint32_t) * size);
+  uint32_t *from = keys;
+  uint32_t *to = buffer;
+  for (int d = 0; d < 4; ++d) {
+    int shift = 8 * d;
+    if (counts[d][(from[0] >> shift) & 0xFF] == size) {
+      continue;
+    }
+    size_t offsets[256];
+    size_t offset = 0;
+    for (int b = 0; b < 256; ++b) {
+      offsets[b] = offset;
+      offset += counts[d][b];
+    }
+    for (size_t i = 0; i < size; ++i) {
+      uint32_t key = from[i];
+      to[offsets[(key >> shift) & 0xFF]++] = key;
+      if ((i & (YIELD_CHECK_STEPS - 1)) == 0) {
+        yield_if_necessary_record_work_time(timer);
+      }
+    }
+    uint32_t *tmp = from;
+    from = to;
+    to = tmp;
+  }
+  for (size_t i = 0; i < size; ++i) {
+    keys[i] = from[i] ^ 0x80000000;
+    if ((i & (YIELD_CHECK_STEPS - 1)) == 0) {
+      yield_if_necessary_record_work_time(timer);
+    }
+  }
+  free(buffer);
+}
+
+typedef void (*sort_f)(int *array, size_t size, struct work_timer *timer);
+
+/**
+ * Sorting algorithm, selectable with -a.
+ */
+struct sort_kernel {
+  const char *name;
+  sort_f sort;
+};
+
+static const struct sort_kernel sort_kernels[] = {
+  {"heap", heap_sort},
+  {"pdq", pdq_sort},
+  {"radix", radix_sort},
+};
+
+#define SORT_KERNELS_COUNT (sizeof(sort_kernels) / sizeof(sort_kernels[0]))
+
+static const struct sort_kernel *sort_kernel_find(const char *name) {
+  for (size_t i = 0; i < SORT_KERNELS_COUNT; ++i) {
+    if (strcmp(sort_kernels[i].name, name) == 0) {
+      return &sort_kernels[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Chooses the sort kernel by a sample of the numbers. Radix sort
+ * does a pass per byte of the value range, and is worth it on big
+ * enough arrays. Pdqsort takes the small and the presorted ones.
+ */
+static const struct sort_kernel *sort_kernel_choose(const int *array, size_t size) {
+  if (size < SORT_SAMPLE_SIZE) {
+    return sort_kernel_find("pdq");
+  }
+  size_t step = size / SORT_SAMPLE_SIZE;
+  int min = array[0];
+  int max = array[0];
+  bool is_ascending = true;
+  bool is_descending = true;
+  for (size_t i = 1; i < SORT_SAMPLE_SIZE; ++i) {
+    int value = array[i * step];
+    int prev = array[(i - 1) * step];
+    is_ascending = is_ascending && prev <= value;
+    is_descending = is_descending && prev >= value;
+    min = value < min ? value : min;
+    max = value > max ? value : max;
+  }
+  if (is_ascending || is_descending) {
+    return sort_kernel_find("pdq");
+  }
+  uint32_t range = (uint32_t)max - (uint32_t)min;
+  int passes = 1;
+  while (passes < 4 && (range >> (8 * passes)) != 0) {
+    ++passes;
+  }
+  if (size < (size_t)passes * RADIX_MIN_SIZE_PER_PASS) {
+    return sort_kernel_find("pdq");
+  }
+  return sort_kernel_find("radix");
+}
+
+/**
+ * Merges two sorted runs into a new one, freeing them.
+ */
+static struct sorted_run *merge_runs(
+  struct sorted_run *a,
+  struct sorted_run *b,
+  struct work_timer *timer
+) {
+  struct sorted_run *run = malloc(sizeof(struct sorted_run));
+  run->size = a->size + b->size;
+  run->numbers = malloc(sizeof(int) * run->size);
+  run->level = (a->level > b->level ? a->level : b->level) + 1;
+  run->fd = -1;
+  run->task = NULL;
+  size_t i = 0;
+  size_t j = 0;
+  size_t k = 0;
+  while (i < a->size && j < b->size) {
+    if (a->numbers[i] <= b->numbers[j]) {
+      run->numbers[k++] = a->numbers[i++];
+    } else {
+      run->numbers[k++] = b->numbers[j++];
+    }
+    yield_check_step(timer);
+  }
+  // A run of an empty file has no numbers array, which memcpy() must
+  // not get.
+  if (i < a->size) {
+    memcpy(run->numbers + k, a->numbers + i, sizeof(int) * (a->size - i));
+    k += a->size - i;
+  }
+  if (j < b->size) {
+    memcpy(run->numbers + k, b->numbers + j, sizeof(int) * (b->size - j));
+  }
+  free(a->numbers);
+  free(a);
+  free(b->numbers);
+  free(b);
+  return run;
+}
+
+/**
+ * Creates a temporary file for a run. It is unlinked right away, so
+ * it is gone with the process. Returns -1 on error.
+ */
+static int create_temp_file(void) {
+  const char *dir = getenv("TMPDIR");
+  if (dir == NULL || *dir == '\0') {
+    dir = "/tmp";
+  }
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/sort-run-XXXXXX", dir);
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+  }
+  return fd;
+}
+
+/**
+ * Writes the whole data without blocking the other coroutines.
+ * Waiting for the writes is not work.
+ */
+static void write_all(int fd, const void *data, size_t size, struct work_timer *timer) {
+  const char *pos = data;
+  if (timer != NULL) {
+    work_timer_stop(timer);
+  }
+  while (size > 0) {
+    ssize_t rc = coro_write(fd, pos, size);
+    if (rc <= 0) {
+      printf("Error writing a temporary file\n");
+      exit(-1);
+    }
+    pos += rc;
+    size -= rc;
+  }
+  if (timer != NULL) {
+    work_timer_start(timer);
+  }
+}
+
+/**
+ * Reads exactly size bytes, like write_all().
+ */
+static void read_all(int fd, void *data, size_t size, struct work_timer *timer) {
+  char *pos = data;
+  if (timer != NULL) {
+    work_timer_stop(timer);
+  }
+  while (size > 0) {
+    ssize_t rc = coro_read(fd, pos, size);
+    if (rc <= 0) {
+      printf("Error reading a temporary file\n");
+      exit(-1);
+    }
+    pos += rc;
+    size -= rc;
+  }
+  if (timer != NULL) {
+    work_timer_start(timer);
+  }
+}
+
+static void sort_numbers(
+  const struct coro_context *ctx,
+  struct number_array *array,
+  struct work_timer *timer
+) {
+  const struct sort_kernel *kernel = ctx->sort_kernel;
+  if (kernel == NULL) {
+    kernel = sort_kernel_choose(array->numbers, array->size);
+  }
+  kernel->sort(array->numbers, array->size, timer);
+}
+
+/**
+ * Spills the numbers of a sorting coroutine in the external mode.
+ */
+struct run_spiller {
+  const struct coro_context *ctx;
+};
+
+/**
+ * Sorts the array, writes it into a temporary file and passes the
+ * run to the merging coroutine. The array is emptied for the next
+ * run.
+ */
+static void run_spill(
+  struct run_spiller *spiller,
+  struct number_array *array,
+  struct work_timer *timer
+) {
+  sort_numbers(spiller->ctx, array, timer);
+  struct sorted_run *run = malloc(sizeof(struct sorted_run));
+  run->numbers = NULL;
+  run->size = array->size;
+  run->level = 0;
+  run->task = NULL;
+  run->fd = create_temp_file();
+  if (run->fd < 0) {
+    printf("Error creating a temporary file\n");
+    exit(-1);
+  }
+  write_all(run->fd, array->numbers, sizeof(int) * array->size, timer);
+  array->size = 0;
+  work_timer_stop(timer);
+  coro_chan_send(spiller->ctx->sorted_runs, run);
+  work_timer_start(timer);
+}
+
+/**
+ * Part of a file to sort. It has the numbers, which start in
+ * [begin, end) of the file.
+ */
+struct file_chunk {
+  const char *filename;
+  off_t begin;
+  /**
+   * -1 for the end of the file.
+   */
+  off_t end;
+
+  /**
+   * True, if the file is a binary run file. It is not cut into
+   * chunks.
+   */
+  bool is_run;
+};
+
+/**
+ * Reads the numbers of the chunk in one pass. The text is parsed
+ * right in the read buffer slice by slice, a number cut by the
+ * buffer end is moved to the buffer start. A number cut by the
+ * chunk begin belongs to the previous chunk and is skipped, one cut
+ * by the chunk end is read to its end. The coroutine is parked
+ * while the reads are in progress, so other coroutines can sort
+ * meanwhile. In the external mode each time the array has a run of
+ * numbers, it is spilled. Returns -1 on error.
+ */
+static int read_numbers(
+  const struct file_chunk *chunk,
+  size_t buffer_size,
+  struct run_spiller *spiller,
+  struct work_timer *timer,
+  struct number_array *array
+) {
+  int fd = coro_open(chunk->filename, O_RDONLY, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  // The byte before the chunk tells if its first number is cut.
+  off_t start = chunk->begin > 0 ? chunk->begin - 1 : 0;
+  if (start > 0 && lseek(fd, start, SEEK_SET) < 0) {
+    close(fd);
+    return -1;
+  }
+  off_t left = chunk->end >= 0 ? chunk->end - start : -1;
+  bool is_head = chunk->begin > 0;
+  bool is_tail = false;
+  size_t limit = spiller != NULL ? spiller->ctx->run_size : SIZE_MAX;
+  char *buffer = malloc(buffer_size + PARSE_PADDING);
+  size_t carry = 0;
+  while (true) {
+    size_t size = buffer_size - carry;
+    if (left >= 0 && !is_tail && (off_t)size > left) {
+      size = left;
+    }
+    // Waiting for the reads is not work.
+    work_timer_stop(timer);
+    ssize_t rc = coro_read(fd, buffer + carry, size);
+    work_timer_start(timer);
+    if (rc < 0) {
+      free(buffer);
+      close(fd);
+      return -1;
+    }
+    bool is_last = rc == 0;
+    if (is_tail) {
+      // Only the rest of the last number is needed.
+      for (ssize_t i = 0; i < rc; ++i) {
+        if (!is_number_char(buffer[carry + i])) {
+          rc = i;
+          is_last = true;
+          break;
+        }
+      }
+    } else if (left >= 0) {
+      left -= rc;
+      // The rest of the file is read only if the last number of the
+      // chunk is cut.
+      if (left == 0) {
+        is_tail = rc > 0 && is_number_char(buffer[carry + rc - 1]);
+        is_last = !is_tail;
+      }
+    }
+    const char *end = buffer + carry + rc;
+    memset(buffer + carry + rc, 0, PARSE_PADDING);
+    const char *p = buffer;
+    if (is_head) {
+      while (p < end && is_number_char(*p)) {
+        ++p;
+      }
+      is_head = p == end;
+    }
+    while (true) {
+      const char *slice_end =
+        end - p > PARSE_SLICE_SIZE ? p + PARSE_SLICE_SIZE : end;
+      p = parse_numbers(p, slice_end, is_last && slice_end == end, limit, array);
+      if (array->size == limit) {
+        run_spill(spiller, array, timer);
+        continue;
+      }
+      yield_if_necessary_record_work_time(timer);
+      if (slice_end == end) {
+        break;
+      }
+    }
+    if (is_last) {
+      break;
+    }
+    carry = end - p;
+    memmove(buffer, p, carry);
+  }
+  free(buffer);
+  close(fd);
+  return 0;
+}
+
+/**
+ * Reads the numbers of a binary run file, mapped into memory, in
+ * slices like read_numbers(). is_sorted tells if they are sorted
+ * already. Returns -1 on error.
+ */
+static int read_run_file(
+  const struct file_chunk *chunk,
+  struct run_spiller *spiller,
+  struct work_timer *timer,
+  struct number_array *array,
+  bool *is_sorted
+) {
+  struct run_file file;
+  if (run_file_open(&file, chunk->filename) != 0) {
+    return -1;
+  }
+  *is_sorted = file.is_sorted;
+  size_t limit = spiller != NULL ? spiller->ctx->run_size : SIZE_MAX;
+  size_t slice_size = PARSE_SLICE_SIZE / sizeof(int);
+  size_t pos = 0;
+  while (pos < file.count) {
+    size_t count = file.count - pos;
+    if (count > slice_size) {
+      count = slice_size;
+    }
+    if (count > limit - array->size) {
+      count = limit - array->size;
+    }
+    number_array_reserve(array, count);
+    memcpy(array->numbers + array->size, file.numbers + pos, sizeof(int) * count);
+    array->size += count;
+    pos += count;
+    if (array->size == limit) {
+      run_spill(spiller, array, timer);
+      continue;
+    }
+    yield_if_necessary_record_work_time(timer);
+  }
+  run_file_close(&file);
+  return 0;
+}
+
+/**
+ * Sorting of a file on the thread pool.
+ */
+struct sort_job {
+  const struct sort_kernel *kernel;
+  int *numbers;
+  size_t size;
+};
+
+static void *sort_job_f(void *arg) {
+  struct sort_job *job = arg;
+  // Pool threads are not coroutines, so they never yield.
+  struct work_timer timer = {
+    .total_work_time = 0,
+    .quantum = LLONG_MAX,
+    .is_preemptive = false,
+    .check_steps = LLONG_MAX,
+    .steps_left = LLONG_MAX,
+  };
+  work_timer_start(&timer);
+  const struct sort_kernel *kernel = job->kernel;
+  if (kernel == NULL) {
+    kernel = sort_kernel_choose(job->numbers, job->size);
+  }
+  kernel->sort(job->numbers, job->size, &timer);
+  free(job);
+  return NULL;
+}
+
+/**
+ * Pushes the sorting of the numbers to the thread pool.
+ */
+static struct thread_task *sort_numbers_async(
+  const struct coro_context *ctx,
+  struct number_array *array
+) {
+  struct sort_job *job = malloc(sizeof(struct sort_job));
+  job->kernel = ctx->sort_kernel;
+  job->numbers = array->numbers;
+  job->size = array->size;
+  struct thread_task *task;
+  thread_task_new(&task, sort_job_f, job);
+  if (thread_pool_push_task(ctx->pool, task) != 0) {
+    printf("Error pushing a task to the thread pool\n");
+    exit(-1);
+  }
+  return task;
+}
+
+/**
+ * Coroutine body, which sorts the files.
+ * This code is executed by all the sorting coroutines. Each sorted
+ * chunk is passed to the merging coroutine right away.
+ */
+static int coroutine_func_f(void *context) {
+  struct coro_context *ctx = context;
+  struct coro *this = coro_this();
+  struct work_timer timer = {
+    .total_work_time = 0,
+    .quantum = ctx->coroutine_quantum,
+    .is_preemptive = ctx->is_preemptive,
+    .check_steps = ctx->yield_check_steps,
+    .steps_left = ctx->yield_check_steps,
+  };
+  work_timer_start(&timer);
+
+  // In the external mode the runs are cut regardless of the files,
+  // and the array is reused for all of them.
+  struct run_spiller spiller = {ctx};
+  struct run_spiller *external = ctx->run_size > 0 ? &spiller : NULL;
+  struct number_array array = {NULL, 0, 0};
+  size_t buffer_size = READ_CHUNK_SIZE;
+  if (external != NULL) {
+    array.numbers = malloc(sizeof(int) * ctx->run_size);
+    array.capacity = ctx->run_size;
+    buffer_size = ctx->io_buffer_size;
+  }
+
+  void *msg;
+  while (coro_chan_recv(ctx->files_to_sort, &msg) == 0) {
+    // "Pick" the chunk to sort.
+    const struct file_chunk *chunk = msg;
+
+    // Read the chunk without blocking the other coroutines.
+    bool is_sorted = false;
+    int rc = chunk->is_run ?
+      read_run_file(chunk, external, &timer, &array, &is_sorted) :
+      read_numbers(chunk, buffer_size, external, &timer, &array);
+    if (rc != 0) {
+      printf("Error opening file %s\n", chunk->filename);
+      exit(-1);
+    }
+    if (external != NULL) {
+      continue;
+    }
+
+    // Sort the numbers with yielding, or let the pool sort them
+    // meanwhile.
+    struct thread_task *task = NULL;
+    if (is_sorted) {
+      // A sorted run file goes to the merge as is.
+    } else if (ctx->pool != NULL) {
+      task = sort_numbers_async(ctx, &array);
+    } else {
+      sort_numbers(ctx, &array, &timer);
+    }
+
+    struct sorted_run *run = malloc(sizeof(struct sorted_run));
+    run->numbers = array.numbers;
+    run->size = array.size;
+    run->level = 0;
+    run->fd = -1;
+    run->task = task;
+    array = (struct number_array){NULL, 0, 0};
+    work_timer_stop(&timer);
+    coro_chan_send(ctx->sorted_runs, run);
+    work_timer_start(&timer);
+  }
+  if (external != NULL) {
+    if (array.size > 0) {
+      run_spill(external, &array, &timer);
+    }
+    free(array.numbers);
+  }
+  coro_chan_send(ctx->sorted_runs, NULL);
+
+  work_timer_stop(&timer);
+  ctx->total_work_time = timer.total_work_time;
+  ctx->total_switch_count = coro_switch_count(this);
+  ctx->has_telemetry = coro_telemetry(this, &ctx->telemetry);
+
+  return 0;
+}
+
+/**
+ * Reader of a spilled run in batches.
+ */
+struct run_reader {
+  int fd;
+  /**
+   * Numbers not read yet.
+   */
+  size_t left;
+  int *buffer;
+  size_t capacity;
+  /**
+   * NULL outside of coroutines.
+   */
+  struct work_timer *timer;
+};
+
+static bool run_reader_refill(struct merge_source *source) {
+  struct run_reader *reader = source->ctx;
+  if (reader->left == 0) {
+    return false;
+  }
+  size_t count = reader->left < reader->capacity ? reader->left : reader->capacity;
+  read_all(reader->fd, reader->buffer, sizeof(int) * count, reader->timer);
+  reader->left -= count;
+  source->pos = reader->buffer;
+  source->end = reader->buffer + count;
+  return true;
+}
+
+/**
+ * K-way merge of spilled runs.
+ */
+struct run_merge {
+  struct merge_tree tree;
+  struct merge_source *sources;
+  struct run_reader *readers;
+  struct sorted_run **runs;
+  int count;
+};
+
+/**
+ * Starts the merge of the runs, each is read with a buffer of
+ * io_buffer_size.
+ */
+static void run_merge_create(
+  struct run_merge *merge,
+  struct sorted_run **runs,
+  int count,
+  size_t io_buffer_size,
+  struct work_timer *timer
+) {
+  merge->runs = runs;
+  merge->count = count;
+  merge->sources = malloc(sizeof(struct merge_source) * count);
+  merge->readers = malloc(sizeof(struct run_reader) * count);
+  for (int i = 0; i < count; ++i) {
+    struct run_reader *reader = &merge->readers[i];
+    reader->fd = runs[i]->fd;
+    reader->left = runs[i]->size;
+    reader->capacity = io_buffer_size / sizeof(int);
+    reader->buffer = malloc(sizeof(int) * reader->capacity);
+    reader->timer = timer;
+    lseek(reader->fd, 0, SEEK_SET);
+    merge->sources[i].pos = NULL;
+    merge->sources[i].end = NULL;
+    merge->sources[i].refill = run_reader_refill;
+    merge->sources[i].ctx = reader;
+  }
+  merge_tree_create(&merge->tree, merge->sources, count);
+}
+
+/**
+ * Ends the merge, closing and freeing the runs.
+ */
+static void run_merge_destroy(struct run_merge *merge) {
+  merge_tree_destroy(&merge->tree);
+  for (int i = 0; i < merge->count; ++i) {
+    free(merge->readers[i].buffer);
+    close(merge->runs[i]->fd);
+    free(merge->runs[i]);
+  }
+  free(merge->readers);
+  free(merge->sources);
+}
+
+/**
+ * Merges the spilled runs into a new spilled one.
+ */
+static struct sorted_run *merge_spilled_runs(
+  struct sorted_run **runs,
+  int count,
+  size_t io_buffer_size,
+  struct work_timer *timer
+) {
+  struct sorted_run *run = malloc(sizeof(struct sorted_run));
+  run->numbers = NULL;
+  run->size = 0;
+  run->level = 0;
+  run->task = NULL;
+  for (int i = 0; i < count; ++i) {
+    run->size += runs[i]->size;
+    if (runs[i]->level >= run->level) {
+      run->level = runs[i]->level + 1;
+    }
+  }
+  run->fd = create_temp_file();
+  if (run->fd < 0) {
+    printf("Error creating a temporary file\n");
+    exit(-1);
+  }
+  struct run_merge merge;
+  run_merge_create(&merge, runs, count, io_buffer_size, timer);
+  size_t capacity = io_buffer_size / sizeof(int);
+  int *buffer = malloc(sizeof(int) * capacity);
+  size_t merged_count;
+  while ((merged_count = merge_tree_pop(&merge.tree, buffer, capacity)) > 0) {
+    write_all(run->fd, buffer, sizeof(int) * merged_count, timer);
+    yield_if_necessary_record_work_time(timer);
+  }
+  free(buffer);
+  run_merge_destroy(&merge);
+  return run;
+}
+
+/**
+ * Merges the first count spilled runs of the merging coroutine into
+ * one, which goes to the end.
+ */
+static void merge_first_spilled_runs(
+  struct merge_context *ctx,
+  int count,
+  struct work_timer *timer
+) {
+  struct sorted_run **runs = malloc(sizeof(struct sorted_run *) * count);
+  memcpy(runs, ctx->runs, sizeof(struct sorted_run *) * count);
+  ctx->runs_count -= count;
+  memmove(
+    ctx->runs,
+    ctx->runs + count,
+    sizeof(struct sorted_run *) * ctx->runs_count
+  );
+  struct sorted_run *run = merge_spilled_runs(runs, count, ctx->io_buffer_size, timer);
+  free(runs);
+  ctx->runs[ctx->runs_count++] = run;
+}
+
+/**
+ * Keeps the run for main().
+ */
+static void push_run(struct merge_context *ctx, struct sorted_run *run) {
+  if (ctx->runs_count == ctx->runs_capacity) {
+    ctx->runs_capacity = ctx->runs_capacity == 0 ? 16 : ctx->runs_capacity * 2;
+    ctx->runs = realloc(
+      ctx->runs,
+      sizeof(struct sorted_run *) * ctx->runs_capacity
+    );
+  }
+  ctx->runs[ctx->runs_count++] = run;
+}
+
+/**
+ * Adds a spilled run. When there are fan_in runs of the same level,
+ * they are merged into one of the next level, like in the binary
+ * counter. All the runs of a level are adjacent and the levels
+ * decrease towards the end, so the merged ones are always the last.
+ */
+static void add_spilled_run(
+  struct merge_context *ctx,
+  struct sorted_run *run,
+  struct work_timer *timer
+) {
+  push_run(ctx, run);
+  while (true) {
+    int count = ctx->runs_count;
+    int level = ctx->runs[count - 1]->level;
+    int same_level = 0;
+    while (same_level < count &&
+           ctx->runs[count - 1 - same_level]->level == level) {
+      ++same_level;
+    }
+    if (same_level < ctx->fan_in) {
+      break;
+    }
+    struct sorted_run **runs = ctx->runs + count - same_level;
+    struct sorted_run *merged = merge_spilled_runs(runs, same_level, ctx->io_buffer_size, timer);
+    ctx->runs_count -= same_level;
+    ctx->runs[ctx->runs_count++] = merged;
+  }
+}
+
+/**
+ * Merges the smallest spilled runs until there are at most
+ * final_fan_in of them.
+ */
+static void reduce_spilled_runs(struct merge_context *ctx, struct work_timer *timer) {
+  while (ctx->runs_count > ctx->final_fan_in) {
+    // The smallest runs go first, the insertion sort is enough for
+    // a few dozens of runs.
+    struct sorted_run **runs = ctx->runs;
+    for (int i = 1; i < ctx->runs_count; ++i) {
+      struct sorted_run *run = runs[i];
+      int j = i;
+      for (; j > 0 && runs[j - 1]->size > run->size; --j) {
+        runs[j] = runs[j - 1];
+      }
+      runs[j] = run;
+    }
+    int count = ctx->runs_count - ctx->final_fan_in + 1;
+    if (count > ctx->final_fan_in) {
+      count = ctx->final_fan_in;
+    }
+    merge_first_spilled_runs(ctx, count, timer);
+  }
+}
+
+/**
+ * Output file of the sequential merge: text through the number
+ * writer, or a binary run file, filled through its mapping.
+ */
+struct output {
+  bool is_binary;
+  struct number_writer writer;
+  struct run_file run_file;
+  size_t size;
+};
+
+/**
+ * Opens the output of count numbers. Returns -1 on error.
+ */
+static int output_open(
+  struct output *output,
+  const char *filename,
+  bool is_binary,
+  size_t count,
+  size_t buffer_size
+) {
+  output->is_binary = is_binary;
+  output->size = 0;
+  if (is_binary) {
+    return run_file_create(&output->run_file, filename, count, true);
+  }
+  return number_writer_open(&output->writer, filename, buffer_size);
+}
+
+static void output_write(struct output *output, const int *numbers, size_t count) {
+  if (output->is_binary) {
+    memcpy(output->run_file.numbers + output->size, numbers, sizeof(int) * count);
+    output->size += count;
+  } else {
+    number_writer_write(&output->writer, numbers, count);
+  }
+}
+
+/**
+ * Returns -1, if anything has failed to be written.
+ */
+static int output_close(struct output *output) {
+  if (output->is_binary) {
+    return run_file_close(&output->run_file);
+  }
+  return number_writer_close(&output->writer);
+}
+
+/**
+ * Batch of merged numbers on the way to the output file.
+ */
+struct output_batch {
+  int *numbers;
+  size_t size;
+};
+
+/**
+ * Context of the output coroutine, the last stage of the merge. It
+ * formats and writes a batch, while the merging coroutine fills the
+ * next one.
+ */
+struct output_context {
+  struct output *output;
+
+  /**
+   * Batches to write. Closed after the last one.
+   */
+  struct coro_chan *full_batches;
+
+  /**
+   * Written batches to be filled again.
+   */
+  struct coro_chan *free_batches;
+
   long long coroutine_quantum;
+  bool is_preemptive;
+  long long total_work_time;
 };
 
-/**
- * Returns the current monotonic time in microseconds.
- */
-static long long get_now() {
-  struct timespec now;
-  clock_gettime(CLOCK_MONOTONIC, &now);
-  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
-}
-
-static void yield_if_necessary_record_work_time(
-  long long *total_work_time,
-  long long *last_work_timer_start,
-  long long quantum
-) {
-  long long work_time = get_now() - *last_work_timer_start;
-  if (work_time > quantum) {
-    *total_work_time += work_time;
-    coro_yield();
-    *last_work_timer_start = get_now();
+static int output_coroutine_f(void *context) {
+  struct output_context *ctx = context;
+  struct work_timer timer = {
+    .total_work_time = 0,
+    .quantum = ctx->coroutine_quantum,
+    .is_preemptive = ctx->is_preemptive,
+  };
+  work_timer_start(&timer);
+  void *msg;
+  while (true) {
+    work_timer_stop(&timer);
+    int rc = coro_chan_recv(ctx->full_batches, &msg);
+    work_timer_start(&timer);
+    if (rc != 0) {
+      break;
+    }
+    struct output_batch *batch = msg;
+    for (size_t pos = 0; pos < batch->size; pos += MERGE_OUTPUT_BATCH) {
+      size_t count = batch->size - pos;
+      if (count > MERGE_OUTPUT_BATCH) {
+        count = MERGE_OUTPUT_BATCH;
+      }
+      output_write(ctx->output, batch->numbers + pos, count);
+      yield_if_necessary_record_work_time(&timer);
+    }
+    coro_chan_send(ctx->free_batches, batch);
   }
+  work_timer_stop(&timer);
+  ctx->total_work_time = timer.total_work_time;
+  return 0;
 }
 
-static void heap_sort(
-  int *array,
-  int size,
-  long long *total_work_time,
-  long long *last_work_timer_start,
-  long long quantum
+/**
+ * Merges the tree of count numbers into the output file. The merge
+ * and the output are two stages of a pipeline: the batches are
+ * merged here and passed to the output coroutine, which formats and
+ * writes them meanwhile. Its writes don't block the merge. Returns
+ * NULL or the error.
+ */
+static const char *merge_to_output(
+  struct merge_context *ctx,
+  struct merge_tree *tree,
+  size_t count,
+  struct work_timer *timer
 ) {
-  for (int i = size / 2 - 1; i >= 0; --i) {
-    int j = i;
-    while (true) {
-      int left = 2 * j + 1;
-      int right = 2 * j + 2;
-      int largest = j;
-      if (left < size && array[left] > array[largest]) {
-        largest = left;
-      }
-      if (right < size && array[right] > array[largest]) {
-        largest = right;
-      }
-      if (largest == j) {
-        break;
-      }
-      int tmp = array[j];
-      array[j] = array[largest];
-      array[largest] = tmp;
-      j = largest;
-
-      yield_if_necessary_record_work_time(
-        total_work_time,
-        last_work_timer_start,
-        quantum
-      );
-    }
+  struct output output;
+  int rc = output_open(
+    &output,
+    ctx->output_filename,
+    ctx->is_binary_output,
+    count,
+    ctx->output_buffer_size
+  );
+  if (rc != 0) {
+    return "Failed to open the output file";
   }
-  for (int i = size - 1; i > 0; --i) {
-    int tmp1 = array[0];
-    array[0] = array[i];
-    array[i] = tmp1;
-    int j = 0;
-    while (true) {
-      int left = 2 * j + 1;
-      int right = 2 * j + 2;
-      int largest = j;
-      if (left < i && array[left] > array[largest]) {
-        largest = left;
-      }
-      if (right < i && array[right] > array[largest]) {
-        largest = right;
+  if (!output.is_binary) {
+    output.writer.write = coro_write;
+  }
+  struct output_context output_ctx = {
+    .output = &output,
+    .full_batches = coro_chan_new(OUTPUT_PIPELINE_DEPTH),
+    .free_batches = coro_chan_new(OUTPUT_PIPELINE_DEPTH),
+    .coroutine_quantum = ctx->coroutine_quantum,
+    .is_preemptive = ctx->is_preemptive,
+    .total_work_time = 0,
+  };
+  // Both channels fit all the batches, so the sends don't block.
+  struct output_batch batches[OUTPUT_PIPELINE_DEPTH];
+  for (int i = 0; i < OUTPUT_PIPELINE_DEPTH; ++i) {
+    batches[i].numbers = malloc(sizeof(int) * ctx->output_batch_size);
+    coro_chan_send(output_ctx.free_batches, &batches[i]);
+  }
+  // Joinable, so the writer is not reaped by coro_sched_wait() in main
+  // when it finishes before the join.
+  struct coro_opts writer_opts = {.joinable = true};
+  struct coro *writer = coro_new_ex(output_coroutine_f, &output_ctx, &writer_opts);
+  while (true) {
+    work_timer_stop(timer);
+    void *msg;
+    coro_chan_recv(output_ctx.free_batches, &msg);
+    work_timer_start(timer);
+    struct output_batch *batch = msg;
+    batch->size = 0;
+    while (batch->size < ctx->output_batch_size) {
+      size_t size = ctx->output_batch_size - batch->size;
+      if (size > MERGE_OUTPUT_BATCH) {
+        size = MERGE_OUTPUT_BATCH;
       }
-      if (largest == j) {
+      size_t merged_count = merge_tree_pop(tree, batch->numbers + batch->size, size);
+      if (merged_count == 0) {
         break;
       }
-      int tmp2 = array[j];
-      array[j] = array[largest];
-      array[largest] = tmp2;
-      j = largest;
-
-      yield_if_necessary_record_work_time(
-        total_work_time,
-        last_work_timer_start,
-        quantum
-      );
+      batch->size += merged_count;
+      yield_if_necessary_record_work_time(timer);
+    }
+    if (batch->size == 0) {
+      break;
     }
+    coro_chan_send(output_ctx.full_batches, batch);
+  }
+  coro_chan_close(output_ctx.full_batches);
+  work_timer_stop(timer);
+  coro_join(writer);
+  work_timer_start(timer);
+  ctx->output_work_time = output_ctx.total_work_time;
+  ctx->output_switch_count = coro_switch_count(writer);
+  ctx->has_output_telemetry = coro_telemetry(writer, &ctx->output_telemetry);
+  coro_delete(writer);
+  for (int i = 0; i < OUTPUT_PIPELINE_DEPTH; ++i) {
+    free(batches[i].numbers);
   }
+  coro_chan_delete(output_ctx.full_batches);
+  coro_chan_delete(output_ctx.free_batches);
+  if (output_close(&output) != 0) {
+    return "Failed to write the output file";
+  }
+  return NULL;
 }
 
 /**
- * Coroutine body, which sorts the files.
- * This code is executed by all the coroutines.
+ * Coroutine body, which merges the sorted runs while the other
+ * files are still being sorted.
  */
-static int coroutine_func_f(void *context) {
-  long long work_timer_last_start = get_now();
-  struct coro_context *ctx = context;
+static int merge_coroutine_f(void *context) {
+  struct merge_context *ctx = context;
   struct coro *this = coro_this();
+  struct work_timer timer = {
+    .total_work_time = 0,
+    .quantum = ctx->coroutine_quantum,
+    .is_preemptive = ctx->is_preemptive,
+    .check_steps = ctx->yield_check_steps,
+    .steps_left = ctx->yield_check_steps,
+  };
+  work_timer_start(&timer);
 
-  while (*ctx->file_to_sort_idx < ctx->files_count) {
-    // "Pick" the file to sort.
-    int taken_file_idx = *ctx->file_to_sort_idx;
-    ++(*ctx->file_to_sort_idx);
-    char *filename = ctx->filenames_to_sort[taken_file_idx];
-
-    // Open the file.
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-      printf("Error opening file %s\n", filename);
-      exit(-1);
+  struct sorted_run **stack = malloc(sizeof(struct sorted_run *) * MERGE_STACK_SIZE);
+  int stack_size = 0;
+  // The runs are taken in the order they are sorted, so a sorter
+  // is never held up by a slower one.
+  int sorters_left = ctx->sorters_count;
+  while (sorters_left > 0) {
+    work_timer_stop(&timer);
+    void *msg;
+    coro_chan_recv(ctx->sorted_runs, &msg);
+    work_timer_start(&timer);
+    if (msg == NULL) {
+      --sorters_left;
+      continue;
+    }
+    if (ctx->fan_in > 0) {
+      add_spilled_run(ctx, msg, &timer);
+      continue;
+    }
+    if (ctx->is_parallel) {
+      push_run(ctx, msg);
+      continue;
     }
+    stack[stack_size++] = msg;
+    while (stack_size > 1 &&
+           stack[stack_size - 1]->level == stack[stack_size - 2]->level) {
+      stack[stack_size - 2] = merge_runs(
+        stack[stack_size - 2], stack[stack_size - 1], &timer);
+      --stack_size;
+    }
+  }
 
-    // Count the number of numbers in the file.
-    int numbers_count = 0;
-    while (!feof(file)) {
-      int tmp;
-      fscanf(file, "%d", &tmp);
-      ++numbers_count;
+  // The last run is sorted, merge the rest into the output. In the
+  // parallel mode main() does it.
+  if (ctx->fan_in > 0) {
+    reduce_spilled_runs(ctx, &timer);
+    size_t count = 0;
+    for (int i = 0; i < ctx->runs_count; ++i) {
+      count += ctx->runs[i]->size;
+    }
+    struct run_merge merge;
+    run_merge_create(&merge, ctx->runs, ctx->runs_count, ctx->io_buffer_size, &timer);
+    ctx->output_error = merge_to_output(ctx, &merge.tree, count, &timer);
+    run_merge_destroy(&merge);
+    free(ctx->runs);
+  } else if (!ctx->is_parallel) {
+    struct merge_source *sources = malloc(sizeof(struct merge_source) * stack_size);
+    size_t count = 0;
+    for (int i = 0; i < stack_size; ++i) {
+      sources[i].pos = stack[i]->numbers;
+      sources[i].end = stack[i]->numbers + stack[i]->size;
+      sources[i].refill = NULL;
+      sources[i].ctx = NULL;
+      count += stack[i]->size;
+    }
+    struct merge_tree tree;
+    merge_tree_create(&tree, sources, stack_size);
+    ctx->output_error = merge_to_output(ctx, &tree, count, &timer);
+    merge_tree_destroy(&tree);
+    free(sources);
+    for (int i = 0; i < stack_size; ++i) {
+      free(stack[i]->numbers);
+      free(stack[i]);
     }
+  }
+  free(stack);
 
-    yield_if_necessary_record_work_time(
-      &ctx->total_work_time,
-      &work_timer_last_start,
-      ctx->coroutine_quantum
-    );
+  work_timer_stop(&timer);
+  ctx->total_work_time = timer.total_work_time;
+  ctx->total_switch_count = coro_switch_count(this);
+  ctx->has_telemetry = coro_telemetry(this, &ctx->telemetry);
 
-    // Allocate memory for the numbers.
-    int *numbers = malloc(sizeof(int) * numbers_count);
+  return 0;
+}
 
-    ctx->sorted_arrays[taken_file_idx] = numbers;
-    ctx->sorted_arrays_sizes[taken_file_idx] = numbers_count;
+/**
+ * Count of the numbers of the sorted run, which are not greater than
+ * the value.
+ */
+static size_t run_count_not_greater(const struct sorted_run *run, long long value) {
+  size_t begin = 0;
+  size_t end = run->size;
+  while (begin < end) {
+    size_t middle = begin + (end - begin) / 2;
+    if (run->numbers[middle] <= value) {
+      begin = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+  return begin;
+}
 
-    // Read the numbers from the file.
-    rewind(file);
-    for (int i = 0; i < numbers_count; ++i) {
-      fscanf(file, "%d", &numbers[i]);
+/**
+ * Merge path of the sorted runs: finds how many first numbers of
+ * each run are among the first rank numbers of their merge, so the
+ * merge can be cut into independent parts. The value of the
+ * rank-th number is found by bisection of the values, its equal
+ * numbers are taken from the runs in order.
+ */
+static void merge_path_split(
+  struct sorted_run **runs,
+  int runs_count,
+  size_t rank,
+  size_t *splits
+) {
+  long long low = INT_MIN;
+  long long high = INT_MAX;
+  while (low < high) {
+    long long middle = low + (high - low) / 2;
+    size_t count = 0;
+    for (int i = 0; i < runs_count; ++i) {
+      count += run_count_not_greater(runs[i], middle);
+    }
+    if (count >= rank) {
+      high = middle;
+    } else {
+      low = middle + 1;
     }
+  }
+  size_t left = rank;
+  for (int i = 0; i < runs_count; ++i) {
+    splits[i] = run_count_not_greater(runs[i], low - 1);
+    left -= splits[i];
+  }
+  for (int i = 0; i < runs_count && left > 0; ++i) {
+    size_t equal_count = run_count_not_greater(runs[i], low) - splits[i];
+    size_t taken = equal_count < left ? equal_count : left;
+    splits[i] += taken;
+    left -= taken;
+  }
+}
 
-    yield_if_necessary_record_work_time(
-      &ctx->total_work_time,
-      &work_timer_last_start,
-      ctx->coroutine_quantum
-    );
+/**
+ * Part of the parallel merge, written by one thread into its own
+ * part of the output file.
+ */
+struct merge_slice {
+  struct sorted_run **runs;
+  int runs_count;
+  /**
+   * [begins[i], ends[i]) of each run goes into the slice.
+   */
+  const size_t *begins;
+  const size_t *ends;
 
-    fclose(file);
+  /**
+   * True, if the slice starts the output.
+   */
+  bool is_first;
+  size_t text_size;
+  int fd;
+  off_t offset;
+  bool is_failed;
 
-    // Sort the numbers with yielding.
-    heap_sort(
-      numbers,
-      numbers_count,
-      &ctx->total_work_time,
-      &work_timer_last_start,
-      ctx->coroutine_quantum
-    );
+  /**
+   * Where the slice goes in a binary output file. NULL for the text
+   * output.
+   */
+  int *out;
+};
+
+/**
+ * Computes the size of the slice text, without merging it. It does
+ * not depend on the order of the numbers.
+ */
+static void *merge_slice_size_f(void *arg) {
+  struct merge_slice *slice = arg;
+  size_t count = 0;
+  size_t size = 0;
+  for (int i = 0; i < slice->runs_count; ++i) {
+    const int *numbers = slice->runs[i]->numbers;
+    for (size_t j = slice->begins[i]; j < slice->ends[i]; ++j) {
+      size += format_int_size(numbers[j]);
+    }
+    count += slice->ends[i] - slice->begins[i];
+  }
+  // Each number but the first one of the output has a separator.
+  if (count > 0) {
+    size += slice->is_first ? count - 1 : count;
   }
+  slice->text_size = size;
+  return NULL;
+}
 
-  ctx->total_work_time += get_now() - work_timer_last_start;
-  ctx->total_switch_count = coro_switch_count(this);
+static void *merge_slice_write_f(void *arg) {
+  struct merge_slice *slice = arg;
+  struct merge_source *sources =
+    malloc(sizeof(struct merge_source) * slice->runs_count);
+  size_t count = 0;
+  for (int i = 0; i < slice->runs_count; ++i) {
+    sources[i].pos = slice->runs[i]->numbers + slice->begins[i];
+    sources[i].end = slice->runs[i]->numbers + slice->ends[i];
+    sources[i].refill = NULL;
+    sources[i].ctx = NULL;
+    count += slice->ends[i] - slice->begins[i];
+  }
+  if (slice->out != NULL) {
+    // The binary output is merged right into its place.
+    struct merge_tree tree;
+    merge_tree_create(&tree, sources, slice->runs_count);
+    merge_tree_pop(&tree, slice->out, count);
+    merge_tree_destroy(&tree);
+    slice->is_failed = false;
+    free(sources);
+    return NULL;
+  }
+  struct number_writer writer;
+  number_writer_open_at(
+    &writer,
+    slice->fd,
+    slice->offset,
+    slice->is_first,
+    PARALLEL_WRITER_BUFFER_SIZE
+  );
+  struct merge_tree tree;
+  merge_tree_create(&tree, sources, slice->runs_count);
+  int *merged = malloc(sizeof(int) * MERGE_OUTPUT_BATCH);
+  size_t merged_count;
+  while ((merged_count = merge_tree_pop(&tree, merged, MERGE_OUTPUT_BATCH)) > 0) {
+    number_writer_write(&writer, merged, merged_count);
+  }
+  merge_tree_destroy(&tree);
+  slice->is_failed = number_writer_close(&writer) != 0;
+  free(merged);
+  free(sources);
+  return NULL;
+}
 
-  return 0;
+/**
+ * Runs the function for each slice on the pool and waits for all of
+ * them.
+ */
+static void merge_slices_run(
+  struct thread_pool *pool,
+  thread_task_f function,
+  struct merge_slice *slices,
+  int slices_count
+) {
+  struct thread_task **tasks = malloc(sizeof(struct thread_task *) * slices_count);
+  for (int i = 0; i < slices_count; ++i) {
+    thread_task_new(&tasks[i], function, &slices[i]);
+    if (thread_pool_push_task(pool, tasks[i]) != 0) {
+      printf("Error pushing a task to the thread pool\n");
+      exit(-1);
+    }
+  }
+  for (int i = 0; i < slices_count; ++i) {
+    void *result;
+    thread_task_join(tasks[i], &result);
+    thread_task_delete(tasks[i]);
+  }
+  free(tasks);
+}
+
+/**
+ * Merges the sorted runs into the file on the threads of the pool.
+ * The merge is cut by the merge path into a slice per thread. The
+ * text sizes of the slices give their offsets in the file, then
+ * each thread merges and writes its slice independently. A slice of
+ * a binary file is merged right into its mapping. Returns -1 on
+ * error.
+ */
+static int merge_parallel(
+  struct thread_pool *pool,
+  int threads_count,
+  struct sorted_run **runs,
+  int runs_count,
+  const char *filename,
+  bool is_binary
+) {
+  size_t total_size = 0;
+  for (int i = 0; i < runs_count; ++i) {
+    total_size += runs[i]->size;
+  }
+  int fd = -1;
+  struct run_file run_file;
+  if (is_binary) {
+    if (run_file_create(&run_file, filename, total_size, true) != 0) {
+      return -1;
+    }
+  } else {
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return -1;
+    }
+  }
+  // Row t is where the slice t begins and the slice t - 1 ends.
+  size_t *splits = malloc(sizeof(size_t) * (threads_count + 1) * runs_count);
+  for (int t = 0; t <= threads_count; ++t) {
+    size_t rank = total_size / threads_count * t +
+      total_size % threads_count * t / threads_count;
+    merge_path_split(runs, runs_count, rank, splits + t * runs_count);
+  }
+  struct merge_slice *slices = malloc(sizeof(struct merge_slice) * threads_count);
+  bool is_first = true;
+  for (int t = 0; t < threads_count; ++t) {
+    struct merge_slice *slice = &slices[t];
+    slice->runs = runs;
+    slice->runs_count = runs_count;
+    slice->begins = splits + t * runs_count;
+    slice->ends = splits + (t + 1) * runs_count;
+    slice->is_first = is_first;
+    slice->fd = fd;
+    slice->out = NULL;
+    if (is_binary) {
+      size_t rank = 0;
+      for (int i = 0; i < runs_count; ++i) {
+        rank += slice->begins[i];
+      }
+      slice->out = run_file.numbers + rank;
+    }
+    for (int i = 0; i < runs_count && is_first; ++i) {
+      is_first = slice->begins[i] == slice->ends[i];
+    }
+  }
+  if (!is_binary) {
+    merge_slices_run(pool, merge_slice_size_f, slices, threads_count);
+    off_t offset = 0;
+    for (int t = 0; t < threads_count; ++t) {
+      slices[t].offset = offset;
+      offset += slices[t].text_size;
+    }
+  }
+  merge_slices_run(pool, merge_slice_write_f, slices, threads_count);
+  int rc = is_binary ? run_file_close(&run_file) : close(fd);
+  for (int t = 0; t < threads_count; ++t) {
+    if (slices[t].is_failed) {
+      rc = -1;
+    }
+  }
+  free(slices);
+  free(splits);
+  return rc;
+}
+
+/**
+ * Prints percentiles of the time slices and of the waits to run
+ * against the quantum.
+ */
+static void print_telemetry(const struct coro_telemetry *t, long long quantum) {
+  const struct coro_hist *hists[] = {&t->slice, &t->wait};
+  const char *names[] = {"slice", "wait"};
+  for (int i = 0; i < 2; ++i) {
+    printf(
+      "  %s p50/p99/max %llu/%llu/%lluμs, quantum %lldμs\n",
+      names[i],
+      coro_hist_percentile(hists[i], 0.5) / 1000,
+      coro_hist_percentile(hists[i], 0.99) / 1000,
+      hists[i]->max / 1000,
+      quantum
+    );
+  }
+  printf(
+    "  switch p50/p99/max %llu/%llu/%lluns\n",
+    coro_hist_percentile(&t->switch_cost, 0.5),
+    coro_hist_percentile(&t->switch_cost, 0.99),
+    t->switch_cost.max
+  );
 }
 
 void print_usage(char *program_name) {
   printf(
-    "Usage: %s [-n <number of coroutines>] [-t <target latency>] file1 ...",
+    "Usage: %s [-n <number of coroutines>] [-t <target latency>] "
+    "[-w <number of worker threads>] [-p] [-s <telemetry file>] "
+    "[-a <sort algorithm>] [-m <memory budget>] [-j <threads>] "
+    "[-c <chunk size>] [-b] file1 ...\n"
+    "  -p  preemptive mode: a timer signals the end of a quantum\n"
+    "  -s  collect scheduling telemetry and write it as JSON\n"
+    "  -a  auto (default), heap, pdq or radix\n"
+    "  -m  external sort within the budget in bytes, with an optional\n"
+    "      K, M or G suffix, through temporary files in $TMPDIR\n"
+    "  -j  sort the files and merge them in memory on that many threads\n"
+    "  -c  sort the files in chunks of that size, 64M by default, or\n"
+    "      whole with 0\n"
+    "  -b  write the output as a binary run file, see runconv\n",
     program_name
   );
 }
 
+/**
+ * Parses a size in bytes with an optional K, M or G suffix. Returns
+ * -1 on error.
+ */
+static long long parse_size(const char *text) {
+  char *end;
+  long long size = strtoll(text, &end, 10);
+  if (end == text || size <= 0) {
+    return -1;
+  }
+  int shift = 0;
+  switch (*end) {
+  case 'K': case 'k': shift = 10; ++end; break;
+  case 'M': case 'm': shift = 20; ++end; break;
+  case 'G': case 'g': shift = 30; ++end; break;
+  }
+  if (*end != '\0' || size > (LLONG_MAX >> shift)) {
+    return -1;
+  }
+  return size << shift;
+}
+
 int main(int argc, char **argv) {
   long long start_time = get_now();
 
   long target_latency = DEFAULT_TARGET_LATENCY;
   long coroutines_count = DEFAULT_COROUTINES;
+  long workers_count = DEFAULT_WORKERS;
+  bool is_preemptive = false;
+  char *telemetry_filename = NULL;
+  const struct sort_kernel *sort_kernel = NULL;
+  long long memory_budget = 0;
+  long threads_count = 0;
+  long long chunk_size = DEFAULT_CHUNK_SIZE;
+  bool is_binary_output = false;
 
   /* Parse CLI arguments. */
   bool args_parsed = true;
@@ -231,9 +2239,78 @@ int main(int argc, char **argv) {
       }
       target_latency = strtol(argv[i + 1], NULL, 10);
       files_count -= 2;
+    } else if (strcmp(argv[i], "-w") == 0) {
+      if (is_last_arg) {
+        args_parsed = false;
+        break;
+      }
+      workers_count = strtol(argv[i + 1], NULL, 10);
+      files_count -= 2;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      if (is_last_arg) {
+        args_parsed = false;
+        break;
+      }
+      telemetry_filename = argv[i + 1];
+      files_count -= 2;
+    } else if (strcmp(argv[i], "-a") == 0) {
+      if (is_last_arg) {
+        args_parsed = false;
+        break;
+      }
+      if (strcmp(argv[i + 1], "auto") != 0) {
+        sort_kernel = sort_kernel_find(argv[i + 1]);
+        if (sort_kernel == NULL) {
+          args_parsed = false;
+          break;
+        }
+      }
+      files_count -= 2;
+    } else if (strcmp(argv[i], "-m") == 0) {
+      if (is_last_arg) {
+        args_parsed = false;
+        break;
+      }
+      memory_budget = parse_size(argv[i + 1]);
+      if (memory_budget < 0) {
+        args_parsed = false;
+        break;
+      }
+      files_count -= 2;
+    } else if (strcmp(argv[i], "-j") == 0) {
+      if (is_last_arg) {
+        args_parsed = false;
+        break;
+      }
+      threads_count = strtol(argv[i + 1], NULL, 10);
+      if (threads_count < 1) {
+        args_parsed = false;
+        break;
+      }
+      files_count -= 2;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      if (is_last_arg) {
+        args_parsed = false;
+        break;
+      }
+      chunk_size = strcmp(argv[i + 1], "0") == 0 ? 0 : parse_size(argv[i + 1]);
+      if (chunk_size < 0) {
+        args_parsed = false;
+        break;
+      }
+      files_count -= 2;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      is_preemptive = true;
+      files_count -= 1;
+    } else if (strcmp(argv[i], "-b") == 0) {
+      is_binary_output = true;
+      files_count -= 1;
     }
   }
-  if (coroutines_count < 1 || target_latency < coroutines_count || files_count < 1) {
+  // The external mode keeps the runs in files, which the parallel
+  // merge does not read.
+  if (coroutines_count < 1 || target_latency < coroutines_count || files_count < 1 ||
+      workers_count < 0 || (threads_count > 0 && memory_budget > 0)) {
     args_parsed = false;
   }
   if (!args_parsed) {
@@ -241,24 +2318,129 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  long long global_coroutine_quantum = target_latency / coroutines_count;
+  // One more coroutine merges the sorted files.
+  long long global_coroutine_quantum = target_latency / (coroutines_count + 1);
   printf(
-    "Sorting %d files, with %ld coroutines, each with %lldμs quantum...\n\n",
+    "Sorting %d files, with %ld coroutines and a merging one, each with "
+    "%lldμs quantum...\n\n",
     files_count,
     coroutines_count,
     global_coroutine_quantum
   );
+  long long yield_check_steps = calibrate_check_steps(global_coroutine_quantum);
+  printf("Reading the clock once per %lld sift steps\n\n", yield_check_steps);
+
+  /*
+   * Split the memory budget of the external mode. Half of it goes to
+   * the runs of the sorting coroutines, which take twice their size
+   * for the radix sort buffer, and the I/O buffers. The other half
+   * is for the merges while the files are being sorted. The final
+   * merge happens when the sorting is over, so it has the whole
+   * budget.
+   */
+  size_t run_size = 0;
+  size_t io_buffer_size = NUMBER_WRITER_BUFFER_SIZE;
+  int fan_in = 0;
+  int final_fan_in = 0;
+  if (memory_budget > 0) {
+    long long io = memory_budget / 64;
+    if (io < EXTERNAL_IO_BUFFER_MIN) {
+      io = EXTERNAL_IO_BUFFER_MIN;
+    } else if (io > EXTERNAL_IO_BUFFER_MAX) {
+      io = EXTERNAL_IO_BUFFER_MAX;
+    }
+    io_buffer_size = io / sizeof(int) * sizeof(int);
+    long long share = memory_budget / 2 / coroutines_count - io;
+    if (share < (long long)(2 * sizeof(int) * EXTERNAL_RUN_SIZE_MIN)) {
+      fprintf(stderr, "Memory budget is too small\n");
+      return 1;
+    }
+    run_size = share / (2 * sizeof(int));
+    long long fan = memory_budget / 2 / io - 1;
+    fan_in = fan > EXTERNAL_FAN_IN_MAX ? EXTERNAL_FAN_IN_MAX : (int)fan;
+    // The output takes a buffer of the writer and the batches in
+    // flight.
+    fan = memory_budget / io - 2 - OUTPUT_PIPELINE_DEPTH;
+    final_fan_in = fan > EXTERNAL_FAN_IN_MAX ? EXTERNAL_FAN_IN_MAX : (int)fan;
+    if (fan_in < 2 || final_fan_in < 2) {
+      fprintf(stderr, "Memory budget is too small\n");
+      return 1;
+    }
+    printf(
+      "External sort within %lld bytes: runs of %zu numbers, %zu bytes "
+      "I/O buffers, merges of %d runs and %d in the end\n\n",
+      memory_budget,
+      run_size,
+      io_buffer_size,
+      fan_in,
+      final_fan_in
+    );
+  }
+
+  struct thread_pool *pool = NULL;
+  if (threads_count > 0) {
+    if (thread_pool_new(threads_count, &pool) != 0) {
+      fprintf(stderr, "The thread pool can have 1 to %d threads\n", TPOOL_MAX_THREADS);
+      return 1;
+    }
+    printf("Sorting and merging on %ld threads of the pool\n\n", threads_count);
+  }
 
   int global_files_count = files_count;
   char **global_filenames_to_sort = argv + (argc - files_count);
-  int global_file_to_sort_idx = 0;
-  int **global_sorted_arrays = malloc(sizeof(int *) * files_count);
-  size_t *global_sorted_arrays_sizes = malloc(sizeof(size_t) * files_count);
+  // Cut the files into chunks. A file, which can't be stat'ed, is
+  // one chunk, and its coroutine reports the error.
+  int chunks_count = 0;
+  int chunks_capacity = files_count;
+  struct file_chunk *chunks = malloc(sizeof(struct file_chunk) * chunks_capacity);
+  for (int i = 0; i < files_count; ++i) {
+    struct stat st;
+    off_t file_size = 0;
+    bool is_run = run_file_is_run(global_filenames_to_sort[i]);
+    if (chunk_size > 0 && !is_run && stat(global_filenames_to_sort[i], &st) == 0) {
+      file_size = st.st_size;
+    }
+    off_t begin = 0;
+    do {
+      if (chunks_count == chunks_capacity) {
+        chunks_capacity *= 2;
+        chunks = realloc(chunks, sizeof(struct file_chunk) * chunks_capacity);
+      }
+      struct file_chunk *chunk = &chunks[chunks_count++];
+      chunk->filename = global_filenames_to_sort[i];
+      chunk->begin = begin;
+      begin += chunk_size;
+      // The last chunk takes whatever is appended meanwhile.
+      chunk->end = begin < file_size ? begin : -1;
+      chunk->is_run = is_run;
+    } while (begin < file_size);
+  }
+  // All the chunks fit into the channel, so the sends don't block.
+  struct coro_chan *global_files_to_sort = coro_chan_new(chunks_count);
+  for (int i = 0; i < chunks_count; ++i) {
+    coro_chan_send(global_files_to_sort, &chunks[i]);
+  }
+  coro_chan_close(global_files_to_sort);
 
-  /* Initialize our coroutine global cooperative scheduler. */
-  coro_sched_init();
+  /*
+   * Initialize our coroutine global cooperative scheduler. With
+   * worker threads the coroutines run on all of them in parallel.
+   */
+  if (workers_count > 0) {
+    printf("Running coroutines on %ld worker threads\n\n", workers_count);
+    coro_sched_init_mt(workers_count);
+  } else {
+    coro_sched_init();
+  }
+  if (is_preemptive && coro_sched_preempt(global_coroutine_quantum) != 0) {
+    fprintf(stderr, "Preemption timers are not supported\n");
+    return 1;
+  }
+  coro_sched_telemetry(telemetry_filename != NULL);
 
   struct coro_context *contexts = malloc(sizeof(struct coro_context) * coroutines_count);
+  // A run per sorter can wait for the merge without blocking it.
+  struct coro_chan *sorted_runs = coro_chan_new(coroutines_count);
 
   /* Start several coroutines. */
   for (int i = 0; i < coroutines_count; ++i) {
@@ -269,12 +2451,18 @@ int main(int argc, char **argv) {
     ctx->name = strdup(name);
     ctx->total_work_time = 0;
     ctx->total_switch_count = 0;
+    ctx->has_telemetry = false;
     ctx->files_count = global_files_count;
     ctx->filenames_to_sort = global_filenames_to_sort;
-    ctx->file_to_sort_idx = &global_file_to_sort_idx;
-    ctx->sorted_arrays = global_sorted_arrays;
-    ctx->sorted_arrays_sizes = global_sorted_arrays_sizes;
+    ctx->files_to_sort = global_files_to_sort;
+    ctx->sorted_runs = sorted_runs;
     ctx->coroutine_quantum = global_coroutine_quantum;
+    ctx->is_preemptive = is_preemptive;
+    ctx->sort_kernel = sort_kernel;
+    ctx->run_size = run_size;
+    ctx->io_buffer_size = io_buffer_size;
+    ctx->pool = pool;
+    ctx->yield_check_steps = yield_check_steps;
 
     printf("Starting coroutine %s...\n", ctx->name);
 
@@ -282,15 +2470,63 @@ int main(int argc, char **argv) {
     coro_new(coroutine_func_f, ctx);
   }
 
+  // Start the merging coroutine.
+  struct merge_context merge_ctx;
+  merge_ctx.name = "merge";
+  merge_ctx.total_work_time = 0;
+  merge_ctx.total_switch_count = 0;
+  merge_ctx.has_telemetry = false;
+  merge_ctx.sorted_runs = sorted_runs;
+  merge_ctx.sorters_count = coroutines_count;
+  merge_ctx.output_filename = OUTPUT_FILE;
+  merge_ctx.is_binary_output = is_binary_output;
+  merge_ctx.output_buffer_size = io_buffer_size;
+  merge_ctx.output_batch_size =
+    memory_budget > 0 ? io_buffer_size / sizeof(int) : OUTPUT_BATCH_SIZE;
+  merge_ctx.output_error = NULL;
+  merge_ctx.output_work_time = 0;
+  merge_ctx.output_switch_count = 0;
+  merge_ctx.has_output_telemetry = false;
+  merge_ctx.fan_in = fan_in;
+  merge_ctx.final_fan_in = final_fan_in;
+  merge_ctx.io_buffer_size = io_buffer_size;
+  merge_ctx.is_parallel = pool != NULL;
+  merge_ctx.runs = NULL;
+  merge_ctx.runs_count = 0;
+  merge_ctx.runs_capacity = 0;
+  merge_ctx.coroutine_quantum = global_coroutine_quantum;
+  merge_ctx.is_preemptive = is_preemptive;
+  merge_ctx.yield_check_steps = yield_check_steps;
+  printf("Starting coroutine %s...\n", merge_ctx.name);
+  coro_new(merge_coroutine_f, &merge_ctx);
+
   /* Wait for all the coroutines to end. */
   struct coro *c;
   while ((c = coro_sched_wait()) != NULL) {
     coro_delete(c);
   }
+  coro_sched_destroy();
+  coro_chan_delete(global_files_to_sort);
+  coro_chan_delete(sorted_runs);
+  free(chunks);
   printf("All coroutines finished\n\n");
 
   /* All coroutines have finished. */
 
+  FILE *telemetry_file = NULL;
+  if (telemetry_filename != NULL) {
+    telemetry_file = fopen(telemetry_filename, "w");
+    if (telemetry_file == NULL) {
+      fprintf(stderr, "Failed to open the telemetry file %s\n", telemetry_filename);
+      return 1;
+    }
+    fprintf(
+      telemetry_file,
+      "{\"quantum_us\": %lld, \"coroutines\": {",
+      global_coroutine_quantum
+    );
+  }
+
   long long coroutines_total_work_time = 0;
   for (int i = 0; i < coroutines_count; ++i) {
     struct coro_context *ctx = &contexts[i];
@@ -302,58 +2538,83 @@ int main(int argc, char **argv) {
       ctx->total_work_time,
       ctx->total_switch_count
     );
+    if (ctx->has_telemetry) {
+      print_telemetry(&ctx->telemetry, global_coroutine_quantum);
+      fprintf(telemetry_file, "\"%s\": ", ctx->name);
+      coro_telemetry_dump(&ctx->telemetry, telemetry_file);
+      fprintf(telemetry_file, ", ");
+    }
     coroutines_total_work_time += ctx->total_work_time;
     free(ctx->name);
   }
   free(contexts);
-
-  // Open the output file.
-  FILE *output_file = fopen(OUTPUT_FILE, "w");
-  if (output_file == NULL) {
-    fprintf(stderr, "Failed to open the output file %s\n", OUTPUT_FILE);
-    return 1;
+  printf(
+    "Coroutine %s\n"
+    "  total work time %lldμs\n"
+    "  total switch count %lld\n",
+    merge_ctx.name,
+    merge_ctx.total_work_time,
+    merge_ctx.total_switch_count
+  );
+  if (merge_ctx.has_telemetry) {
+    print_telemetry(&merge_ctx.telemetry, global_coroutine_quantum);
+    fprintf(telemetry_file, "\"%s\": ", merge_ctx.name);
+    coro_telemetry_dump(&merge_ctx.telemetry, telemetry_file);
   }
-
-  // Merge sorted arrays into the output file.
-  size_t *current_indices = malloc(sizeof(size_t) * files_count);
-  for (int i = 0; i < files_count; ++i) {
-    current_indices[i] = 0;
+  coroutines_total_work_time += merge_ctx.total_work_time;
+  if (pool == NULL) {
+    printf(
+      "Coroutine output\n"
+      "  total work time %lldμs\n"
+      "  total switch count %lld\n",
+      merge_ctx.output_work_time,
+      merge_ctx.output_switch_count
+    );
+    // The waits of the output show the stalls of the writes.
+    if (merge_ctx.has_output_telemetry) {
+      print_telemetry(&merge_ctx.output_telemetry, global_coroutine_quantum);
+      fprintf(telemetry_file, ", \"output\": ");
+      coro_telemetry_dump(&merge_ctx.output_telemetry, telemetry_file);
+    }
+    coroutines_total_work_time += merge_ctx.output_work_time;
+  }
+  if (telemetry_file != NULL) {
+    fprintf(telemetry_file, "}}\n");
+    fclose(telemetry_file);
   }
 
-  bool first = true;
-  while (true) {
-    if (!first) {
-      fprintf(output_file, " ");
-    }
-    int min_value = INT_MAX;
-    int min_value_idx = -1;
-    for (int i = 0; i < files_count; ++i) {
-      if (current_indices[i] < global_sorted_arrays_sizes[i]) {
-        int value = global_sorted_arrays[i][current_indices[i]];
-        if (value < min_value) {
-          min_value = value;
-          min_value_idx = i;
-        }
+  if (pool != NULL) {
+    // Wait for the sorting of the runs to end and merge them.
+    for (int i = 0; i < merge_ctx.runs_count; ++i) {
+      if (merge_ctx.runs[i]->task == NULL) {
+        continue;
       }
+      void *result;
+      thread_task_join(merge_ctx.runs[i]->task, &result);
+      thread_task_delete(merge_ctx.runs[i]->task);
     }
-    if (min_value_idx == -1) {
-      break;
+    int rc = merge_parallel(
+      pool,
+      threads_count,
+      merge_ctx.runs,
+      merge_ctx.runs_count,
+      OUTPUT_FILE,
+      is_binary_output
+    );
+    if (rc != 0) {
+      fprintf(stderr, "Failed to write the output file %s\n", OUTPUT_FILE);
+      return 1;
     }
-    fprintf(output_file, "%d", min_value);
-    ++current_indices[min_value_idx];
-    first = false;
-  }
-
-  // Close the output file.
-  fclose(output_file);
-
-  // Free memory.
-  free(current_indices);
-  for (int i = 0; i < files_count; ++i) {
-    free(global_sorted_arrays[i]);
+    for (int i = 0; i < merge_ctx.runs_count; ++i) {
+      free(merge_ctx.runs[i]->numbers);
+      free(merge_ctx.runs[i]);
+    }
+    free(merge_ctx.runs);
+    thread_pool_delete(pool);
+  } else if (merge_ctx.output_error != NULL) {
+    fprintf(stderr, "%s %s\n", merge_ctx.output_error, OUTPUT_FILE);
+    return 1;
   }
-  free(global_sorted_arrays);
-  free(global_sorted_arrays_sizes);
 
   long long total_work_time = get_now() - start_time;
 
@@ -0,0 +1,1092 @@
+#include "libcoro.h"
+#include "unit.h"
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+static int
+coro_ret_arg_f(void *arg)
+{
+	return *(int *)arg;
+}
+
+static void
+test_basic(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	unit_check(coro_sched_wait() == NULL, "no coroutines - nothing to wait");
+	int arg = 42;
+	struct coro *c = coro_new(coro_ret_arg_f, &arg);
+	unit_check(! coro_is_finished(c), "not started before wait");
+	unit_check(coro_sched_wait() == c, "waited the coroutine");
+	unit_check(coro_is_finished(c), "finished");
+	unit_check(coro_status(c) == 42, "status is the function result");
+	coro_delete(c);
+	unit_check(coro_sched_wait() == NULL, "nothing left");
+
+	unit_test_finish();
+}
+
+struct yield_arg {
+	int id;
+	int *log;
+	int *log_size;
+};
+
+static int
+coro_yield_log_f(void *arg)
+{
+	struct yield_arg *a = arg;
+	/*
+	 * Callee-saved registers and the stack must survive the
+	 * switches.
+	 */
+	long sum = 0;
+	double fsum = 0;
+	for (int i = 0; i < 3; ++i) {
+		a->log[(*a->log_size)++] = a->id;
+		sum += i + a->id;
+		fsum += 0.5 * a->id;
+		coro_yield();
+	}
+	return sum == 3 + 3 * a->id && fsum == 1.5 * a->id;
+}
+
+static void
+test_yield(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int log[64];
+	int log_size = 0;
+	struct yield_arg args[3];
+	for (int i = 0; i < 3; ++i) {
+		args[i].id = i;
+		args[i].log = log;
+		args[i].log_size = &log_size;
+		coro_new(coro_yield_log_f, &args[i]);
+	}
+	int finished = 0;
+	bool ok = true;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		ok = ok && coro_status(c) == 1;
+		unit_fail_if(coro_switch_count(c) < 3);
+		coro_delete(c);
+		++finished;
+	}
+	unit_check(finished == 3, "all finished");
+	unit_check(ok, "registers survived the switches");
+	unit_check(log_size == 9, "each coroutine made all the steps");
+	bool is_interleaved = true;
+	for (int i = 0; i < 3; ++i)
+		is_interleaved = is_interleaved && log[i] != log[i + 1];
+	unit_check(is_interleaved, "coroutines are interleaved");
+
+	unit_test_finish();
+}
+
+static void
+test_many(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	const int count = 1000;
+	int arg = 1;
+	for (int i = 0; i < count; ++i)
+		coro_new(coro_ret_arg_f, &arg);
+	int sum = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		sum += coro_status(c);
+		coro_delete(c);
+	}
+	unit_check(sum == count, "many coroutines");
+
+	unit_test_finish();
+}
+
+static void
+test_stack_pool(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct coro_stack_pool_stats stats;
+	coro_stack_pool_stats(&stats);
+	size_t cached = stats.cached;
+	unit_check(stats.used == 0, "no used stacks");
+	int arg = 0;
+	struct coro *c1 = coro_new(coro_ret_arg_f, &arg);
+	struct coro *c2 = coro_new(coro_ret_arg_f, &arg);
+	coro_stack_pool_stats(&stats);
+	unit_check(stats.used == 2, "2 used stacks");
+	unit_check(stats.cached + 2 >= cached, "cached stacks are reused");
+	unit_check(stats.resident < 2 * 1024 * 1024,
+		   "stacks are committed lazily");
+	size_t resident = stats.resident;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		unit_fail_if(c != c1 && c != c2);
+	coro_delete(c1);
+	coro_delete(c2);
+	coro_stack_pool_stats(&stats);
+	unit_check(stats.used == 0 && stats.used_peak >= 2, "used peak");
+	unit_check(stats.cached >= 2, "freed stacks are cached");
+	unit_check(stats.resident_sampled_peak >= resident &&
+		   stats.resident_sampled_peak >= stats.resident,
+		   "resident peak covers all the samples");
+
+	unit_test_finish();
+}
+
+static int
+coro_use_stack_f(void *arg)
+{
+	volatile char buf[4096];
+	for (int i = 0; i < (int)sizeof(buf); ++i)
+		buf[i] = i;
+	coro_yield();
+	return buf[*(int *)arg];
+}
+
+static void
+test_stack_opts(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int arg = 1;
+	struct coro_opts opts = {
+		.stack_size = 16 * 1024,
+		.paint_stack = true,
+	};
+	struct coro *painted = coro_new_ex(coro_use_stack_f, &arg, &opts);
+	struct coro *plain = coro_new_ex(coro_use_stack_f, &arg, NULL);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		unit_fail_if(coro_status(c) != 1);
+	size_t used = coro_stack_used(painted);
+	unit_msg("used %zu bytes of stack", used);
+	unit_check(used >= 4096 && used < 16 * 1024, "stack usage is measured");
+	unit_check(coro_stack_used(plain) == 0, "not painted stack");
+	coro_delete(painted);
+	coro_delete(plain);
+
+	unit_test_finish();
+}
+
+static int
+coro_mt_child_f(void *arg)
+{
+	for (int i = 0; i < 10; ++i) {
+		__atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return 1;
+}
+
+static int
+coro_mt_parent_f(void *arg)
+{
+	for (int i = 0; i < 10; ++i) {
+		coro_new(coro_mt_child_f, arg);
+		coro_yield();
+	}
+	return coro_mt_child_f(arg);
+}
+
+static void
+test_mt(void)
+{
+	unit_test_start();
+
+	coro_sched_init_mt(4);
+	int counter = 0;
+	const int count = 100;
+	for (int i = 0; i < count; ++i)
+		coro_new(coro_mt_parent_f, &counter);
+	int finished = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		unit_fail_if(coro_status(c) != 1);
+		coro_delete(c);
+		++finished;
+	}
+	unit_check(finished == count * 11, "all coroutines finished");
+	unit_check(counter == count * 11 * 10, "all yields are done");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static const char *io_test_path = "libcoro_test_io.txt";
+static const char io_test_data[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+static int
+coro_io_read_f(void *arg)
+{
+	(void)arg;
+	int fd = coro_open(io_test_path, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	char buf[sizeof(io_test_data)];
+	size_t size = 0;
+	ssize_t rc;
+	while ((rc = coro_read(fd, buf + size, 5)) > 0)
+		size += rc;
+	close(fd);
+	return rc == 0 && size == strlen(io_test_data) &&
+	       memcmp(buf, io_test_data, size) == 0;
+}
+
+static void
+test_io_in_sched(void)
+{
+	int count = 10;
+	for (int i = 0; i < count; ++i)
+		coro_new(coro_io_read_f, NULL);
+	int ok = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		ok += coro_status(c) == 1;
+		coro_delete(c);
+	}
+	unit_check(ok == count, "files are read by coroutines");
+}
+
+static int
+coro_io_open_fail_f(void *arg)
+{
+	(void)arg;
+	return coro_open("not_existing_file", O_RDONLY, 0) == -1 &&
+	       errno == ENOENT;
+}
+
+static int
+coro_io_write_f(void *arg)
+{
+	const char *path = arg;
+	int fd = coro_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	size_t size = strlen(io_test_data);
+	/* In two parts, at the current position. */
+	ssize_t rc1 = coro_write(fd, io_test_data, 10);
+	ssize_t rc2 = coro_write(fd, io_test_data + 10, size - 10);
+	close(fd);
+	return rc1 == 10 && rc2 == (ssize_t)(size - 10);
+}
+
+static void
+test_io(void)
+{
+	unit_test_start();
+
+	int fd = open(io_test_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	unit_fail_if(fd < 0);
+	unit_fail_if(write(fd, io_test_data, strlen(io_test_data)) !=
+		     (ssize_t)strlen(io_test_data));
+	close(fd);
+
+	coro_sched_init();
+	test_io_in_sched();
+	struct coro *c = coro_new(coro_io_open_fail_f, NULL);
+	unit_fail_if(coro_sched_wait() != c);
+	unit_check(coro_status(c) == 1, "open error is returned");
+	coro_delete(c);
+	unlink(io_test_path);
+	c = coro_new(coro_io_write_f, (void *)io_test_path);
+	unit_fail_if(coro_sched_wait() != c);
+	unit_fail_if(coro_status(c) != 1);
+	coro_delete(c);
+	unit_check(coro_io_read_f(NULL) == 1, "file is written by a coroutine");
+
+	coro_sched_init_mt(3);
+	test_io_in_sched();
+	coro_sched_destroy();
+
+	unit_check(coro_io_read_f(NULL) == 1, "blocking I/O outside of coroutines");
+	unlink(io_test_path);
+
+	unit_test_finish();
+}
+
+struct sync_arg {
+	struct coro_mutex *mutex;
+	struct coro_cond *cond;
+	struct coro_chan *chan;
+	struct coro_wait_group *wg;
+	int in_critical_section;
+	int counter;
+	bool is_ready;
+};
+
+static int
+coro_mutex_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	bool ok = true;
+	for (int i = 0; i < 10; ++i) {
+		coro_mutex_lock(a->mutex);
+		ok = ok && __atomic_add_fetch(&a->in_critical_section, 1,
+					      __ATOMIC_SEQ_CST) == 1;
+		coro_yield();
+		++a->counter;
+		__atomic_sub_fetch(&a->in_critical_section, 1, __ATOMIC_SEQ_CST);
+		coro_mutex_unlock(a->mutex);
+		coro_yield();
+	}
+	coro_wait_group_done(a->wg);
+	return ok;
+}
+
+static int
+coro_cond_wait_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	coro_mutex_lock(a->mutex);
+	while (! a->is_ready)
+		coro_cond_wait(a->cond, a->mutex);
+	coro_mutex_unlock(a->mutex);
+	return 1;
+}
+
+static int
+coro_wait_group_wait_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	coro_wait_group_wait(a->wg);
+	/* All the mutex coroutines are done here. */
+	coro_mutex_lock(a->mutex);
+	a->is_ready = true;
+	coro_cond_broadcast(a->cond);
+	coro_mutex_unlock(a->mutex);
+	return a->counter == 50;
+}
+
+static int
+coro_chan_producer_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	for (intptr_t i = 1; i <= 100; ++i) {
+		if (coro_chan_send(a->chan, (void *)i) != 0)
+			return 0;
+	}
+	coro_chan_close(a->chan);
+	return 1;
+}
+
+static int
+coro_chan_consumer_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	intptr_t expected = 1;
+	void *msg;
+	while (coro_chan_recv(a->chan, &msg) == 0) {
+		if ((intptr_t)msg != expected++)
+			return 0;
+	}
+	return expected == 101;
+}
+
+static void
+test_sync_in_sched(void)
+{
+	struct sync_arg a;
+	memset(&a, 0, sizeof(a));
+	a.mutex = coro_mutex_new();
+	a.cond = coro_cond_new();
+	a.chan = coro_chan_new(2);
+	a.wg = coro_wait_group_new();
+	coro_new(coro_cond_wait_f, &a);
+	coro_new(coro_cond_wait_f, &a);
+	coro_wait_group_add(a.wg, 5);
+	for (int i = 0; i < 5; ++i)
+		coro_new(coro_mutex_f, &a);
+	coro_new(coro_wait_group_wait_f, &a);
+	coro_new(coro_chan_consumer_f, &a);
+	coro_new(coro_chan_producer_f, &a);
+	int ok = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		ok += coro_status(c);
+		coro_delete(c);
+	}
+	unit_check(ok == 10, "mutex, cond, wait group and channel");
+	coro_mutex_delete(a.mutex);
+	coro_cond_delete(a.cond);
+	coro_chan_delete(a.chan);
+	coro_wait_group_delete(a.wg);
+}
+
+static void
+test_sync(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	test_sync_in_sched();
+	coro_sched_init_mt(3);
+	test_sync_in_sched();
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_spin_f(void *arg)
+{
+	long long checks = 0;
+	while (! __atomic_load_n((bool *)arg, __ATOMIC_RELAXED)) {
+		coro_preempt_check();
+		++checks;
+	}
+	return checks > 0;
+}
+
+static int
+coro_set_flag_f(void *arg)
+{
+	__atomic_store_n((bool *)arg, true, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static void
+test_preempt_in_sched(void)
+{
+	bool flag = false;
+	/* Without preemption the spinner would never let it go. */
+	coro_new(coro_spin_f, &flag);
+	coro_new(coro_set_flag_f, &flag);
+	int ok = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		ok += coro_status(c);
+		coro_delete(c);
+	}
+	unit_check(ok == 2, "spinning coroutine is preempted");
+}
+
+static void
+test_preempt(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	unit_fail_if(coro_sched_preempt(1000) != 0);
+	test_preempt_in_sched();
+	unit_fail_if(coro_sched_preempt(0) != 0);
+
+	coro_sched_init_mt(1);
+	unit_fail_if(coro_sched_preempt(1000) != 0);
+	test_preempt_in_sched();
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_gen_range_f(struct coro_gen *gen, void *arg)
+{
+	intptr_t count = (intptr_t)arg;
+	for (intptr_t i = 1; i <= count; ++i) {
+		if (coro_gen_yield(gen, (void *)i) != 0)
+			return i;
+	}
+	return 0;
+}
+
+static int
+coro_gen_consumer_f(void *arg)
+{
+	(void)arg;
+	struct coro_gen *gen = coro_gen_new(coro_gen_range_f, (void *)100);
+	intptr_t sum = 0;
+	void *value;
+	while (coro_gen_next(gen, &value) == 0)
+		sum += (intptr_t)value;
+	coro_gen_delete(gen);
+	return sum == 5050;
+}
+
+static int
+coro_gen_early_delete_f(void *arg)
+{
+	(void)arg;
+	struct coro_gen *gen = coro_gen_new(coro_gen_range_f, (void *)100);
+	void *value;
+	for (int i = 0; i < 3; ++i) {
+		if (coro_gen_next(gen, &value) != 0 ||
+		    (intptr_t)value != i + 1)
+			return 0;
+	}
+	coro_gen_delete(gen);
+	return 1;
+}
+
+static void
+test_gen_in_sched(void)
+{
+	coro_new(coro_gen_consumer_f, NULL);
+	coro_new(coro_gen_early_delete_f, NULL);
+	int status_sum = 0;
+	int count = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		status_sum += coro_status(c);
+		++count;
+		coro_delete(c);
+	}
+	/*
+	 * The full producer returns 0, the stopped one - the value it
+	 * has failed to yield: the 4th or the 5th, up to two ahead.
+	 */
+	unit_check(count == 4, "generators are finished");
+	unit_check(status_sum == 2 + 4 || status_sum == 2 + 5,
+		   "values are consumed, deleted generator is stopped");
+}
+
+static void
+test_gen(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	test_gen_in_sched();
+	coro_sched_init_mt(3);
+	test_gen_in_sched();
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_telemetry_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	struct coro_telemetry t;
+	if (! coro_telemetry(coro_this(), &t))
+		return 0;
+	/* The first slice and 10 after the yields, but the last one. */
+	return t.slice.count == 10 && t.wait.count == 11 &&
+	       t.switch_cost.count == 11;
+}
+
+static void
+test_telemetry(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct coro *c = coro_new(coro_telemetry_f, NULL);
+	struct coro_telemetry t;
+	unit_check(! coro_telemetry(c, &t), "off by default");
+	coro_sched_wait();
+	coro_delete(c);
+
+	coro_sched_telemetry(true);
+	c = coro_new(coro_telemetry_f, NULL);
+	coro_new(coro_telemetry_f, NULL);
+	int ok = 0;
+	struct coro *c2;
+	while ((c2 = coro_sched_wait()) != NULL) {
+		ok += coro_status(c2);
+		if (c2 != c)
+			coro_delete(c2);
+	}
+	unit_check(ok == 2, "slices, waits and switches are counted");
+	unit_fail_if(! coro_telemetry(c, &t));
+	unit_check(t.slice.count == 11, "the last slice is counted");
+	unsigned long long p50 = coro_hist_percentile(&t.slice, 0.5);
+	unsigned long long p99 = coro_hist_percentile(&t.slice, 0.99);
+	unit_check(p50 <= p99 && p99 <= t.slice.max && t.slice.max > 0,
+		   "percentiles");
+
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&buf, &size);
+	coro_telemetry_dump(&t, f);
+	fclose(f);
+	const char *prefix = "{\"slice\": {\"count\": 11,";
+	unit_check(strncmp(buf, prefix, strlen(prefix)) == 0 &&
+		   buf[size - 1] == '}', "JSON dump");
+	free(buf);
+	coro_delete(c);
+
+	struct coro_hist h;
+	memset(&h, 0, sizeof(h));
+	unit_check(coro_hist_percentile(&h, 0.99) == 0, "empty histogram");
+
+	unit_test_finish();
+}
+
+struct policy_arg {
+	/** Order, in which the coroutines have run first time. */
+	int order[8];
+	int order_count;
+	int id;
+};
+
+static int
+coro_order_f(void *arg)
+{
+	struct policy_arg *a = arg;
+	int id = a->id++;
+	a->order[a->order_count++] = id;
+	return id;
+}
+
+static int
+coro_prio_yield_f(void *arg)
+{
+	(void)arg;
+	/* Lower priority coroutines don't take the turn. */
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	return coro_switch_count(coro_this()) == 0;
+}
+
+struct fair_arg {
+	/** Work units, done by the coroutines of each weight. */
+	long long done[2];
+	long long total;
+};
+
+struct fair_coro_arg {
+	struct fair_arg *fair;
+	int idx;
+};
+
+static int
+coro_fair_f(void *arg)
+{
+	struct fair_coro_arg *a = arg;
+	while (a->fair->total < 2000) {
+		/* A unit of work, about the same each time. */
+		volatile int sink = 0;
+		for (int i = 0; i < 10000; ++i)
+			sink += i;
+		++a->fair->done[a->idx];
+		++a->fair->total;
+		coro_yield();
+	}
+	return 0;
+}
+
+static int
+coro_prio_waiter_f(void *arg)
+{
+	void *msg;
+	coro_chan_recv(arg, &msg);
+	__atomic_store_n((bool *)msg, true, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static void
+test_policy(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct policy_arg a;
+	memset(&a, 0, sizeof(a));
+	struct coro_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.policy = CORO_SCHED_PRIO;
+	struct coro_opts fair_opts;
+	memset(&fair_opts, 0, sizeof(fair_opts));
+	fair_opts.policy = CORO_SCHED_FAIR;
+	/* The ids are given by the start order. */
+	struct coro *fair = coro_new_ex(coro_order_f, &a, &fair_opts);
+	struct coro *rr = coro_new(coro_order_f, &a);
+	opts.priority = 1;
+	struct coro *low = coro_new_ex(coro_order_f, &a, &opts);
+	opts.priority = 5;
+	struct coro *high = coro_new_ex(coro_order_f, &a, &opts);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		;
+	unit_check(coro_status(high) == 0 && coro_status(low) == 1 &&
+		   coro_status(rr) == 2 && coro_status(fair) == 3,
+		   "priority, round-robin, fair");
+	coro_delete(fair);
+	coro_delete(rr);
+	coro_delete(low);
+	coro_delete(high);
+
+	coro_new(coro_order_f, &a);
+	coro_new_ex(coro_prio_yield_f, NULL, &opts);
+	int ok = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		ok += coro_status(c) == 1;
+		coro_delete(c);
+	}
+	unit_check(ok == 1, "higher priority keeps running on yield");
+
+	coro_sched_policy(CORO_SCHED_FAIR);
+	struct fair_arg f;
+	memset(&f, 0, sizeof(f));
+	struct fair_coro_arg args[2] = {{&f, 0}, {&f, 1}};
+	coro_new(coro_fair_f, &args[0]);
+	fair_opts.weight = 3 * CORO_WEIGHT_DEFAULT;
+	coro_new_ex(coro_fair_f, &args[1], &fair_opts);
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_msg("fair share done %lld/%lld", f.done[0], f.done[1]);
+	unit_check(f.done[1] > 2 * f.done[0], "share is by weight");
+
+	/*
+	 * A low priority coroutine spins until a high priority one,
+	 * woken up by another thread, preempts it.
+	 */
+	coro_sched_init_mt(1);
+	struct coro_chan *ch = coro_chan_new(1);
+	opts.priority = 5;
+	coro_new_ex(coro_prio_waiter_f, ch, &opts);
+	bool flag = false;
+	opts.priority = 0;
+	coro_new_ex(coro_spin_f, &flag, &opts);
+	usleep(10000);
+	coro_chan_send(ch, &flag);
+	ok = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		ok += coro_status(c);
+		coro_delete(c);
+	}
+	unit_check(ok == 2, "wakeup of a higher priority preempts");
+	coro_chan_delete(ch);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct shard_arg {
+	/** Channel between the schedulers of two threads. */
+	struct coro_chan *chan;
+	bool is_producer;
+	long long sum;
+	bool is_ok;
+};
+
+static int
+coro_shard_producer_f(void *arg)
+{
+	struct shard_arg *a = arg;
+	for (intptr_t i = 1; i <= 100; ++i)
+		coro_chan_send(a->chan, (void *)i);
+	coro_chan_close(a->chan);
+	return 0;
+}
+
+static int
+coro_shard_consumer_f(void *arg)
+{
+	struct shard_arg *a = arg;
+	void *msg;
+	while (coro_chan_recv(a->chan, &msg) == 0) {
+		a->sum += (intptr_t)msg;
+		coro_yield();
+	}
+	return 0;
+}
+
+static int
+coro_shard_local_f(void *arg)
+{
+	struct shard_arg *a = arg;
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	__atomic_add_fetch(&a->sum, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void *
+shard_thread_f(void *arg)
+{
+	struct shard_arg *a = arg;
+	struct coro_scheduler *s = coro_scheduler_new();
+	coro_scheduler_set(s);
+	a->is_ok = coro_scheduler_this() == s;
+	coro_new(a->is_producer ? coro_shard_producer_f :
+		 coro_shard_consumer_f, a);
+	for (int i = 0; i < 10; ++i)
+		coro_new(coro_shard_local_f, a);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		a->is_ok = a->is_ok && coro_scheduler_this() == s;
+		coro_delete(c);
+	}
+	coro_scheduler_delete(s);
+	a->is_ok = a->is_ok && coro_scheduler_this() == NULL;
+	return NULL;
+}
+
+static void
+test_schedulers(void)
+{
+	unit_test_start();
+
+	struct shard_arg args[2];
+	memset(args, 0, sizeof(args));
+	struct coro_chan *chan = coro_chan_new(1);
+	pthread_t threads[2];
+	for (int i = 0; i < 2; ++i) {
+		args[i].chan = chan;
+		args[i].is_producer = i == 0;
+		pthread_create(&threads[i], NULL, shard_thread_f, &args[i]);
+	}
+	for (int i = 0; i < 2; ++i)
+		pthread_join(threads[i], NULL);
+	coro_chan_delete(chan);
+	unit_check(args[0].is_ok && args[1].is_ok,
+		   "each thread has its own scheduler");
+	unit_check(args[0].sum == 10 && args[1].sum == 10 + 5050,
+		   "coroutines of different schedulers talk");
+
+	unit_test_finish();
+}
+
+static int
+coro_deep_f(int depth, int seed)
+{
+	/* Fill the frame with a pattern, check it after a yield. */
+	int buf[64];
+	for (int i = 0; i < 64; ++i)
+		buf[i] = seed * 1000 + depth * 64 + i;
+	coro_yield();
+	int ok = depth == 0 ? 1 : coro_deep_f(depth - 1, seed);
+	coro_yield();
+	for (int i = 0; i < 64; ++i)
+		ok = ok && buf[i] == seed * 1000 + depth * 64 + i;
+	return ok;
+}
+
+static int
+coro_shared_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	int seed = (int)(intptr_t)coro_this() & 0xffff;
+	int ok = coro_deep_f(seed % 8, seed);
+	/* Waiting in the primitives, while the stack is swapped out. */
+	coro_mutex_lock(a->mutex);
+	coro_yield();
+	coro_mutex_unlock(a->mutex);
+	void *msg;
+	if (coro_chan_recv(a->chan, &msg) != 0 || msg != a)
+		ok = 0;
+	return ok;
+}
+
+static int
+coro_shared_sender_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	for (int i = 0; i < 20; ++i)
+		coro_chan_send(a->chan, a);
+	return 1;
+}
+
+static int
+test_shared_stack_in_sched(void)
+{
+	struct sync_arg a;
+	memset(&a, 0, sizeof(a));
+	a.mutex = coro_mutex_new();
+	a.chan = coro_chan_new(1);
+	struct coro_shared_stack *ss = coro_shared_stack_new(64 * 1024);
+	struct coro_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.shared_stack = ss;
+	for (int i = 0; i < 10; ++i)
+		coro_new_ex(coro_shared_f, &a, &opts);
+	/* Other coroutines on own stacks. */
+	coro_new(coro_shared_f, &a);
+	coro_new(coro_shared_sender_f, &a);
+	for (int i = 0; i < 9; ++i)
+		coro_new_ex(coro_shared_f, &a, &opts);
+	int ok = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		ok += coro_status(c);
+		coro_delete(c);
+	}
+	coro_shared_stack_delete(ss);
+	coro_mutex_delete(a.mutex);
+	coro_chan_delete(a.chan);
+	return ok;
+}
+
+static void
+test_shared_stack(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	unit_check(test_shared_stack_in_sched() == 21,
+		   "stacks are swapped");
+	/* Not supported, the coroutines get own stacks. */
+	coro_sched_init_mt(2);
+	unit_check(test_shared_stack_in_sched() == 21,
+		   "own stacks in M:N mode");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_fib_f(void *arg)
+{
+	intptr_t n = (intptr_t)arg;
+	if (n < 2)
+		return n;
+	struct coro *a = coro_new(coro_fib_f, (void *)(n - 1));
+	struct coro *b = coro_new(coro_fib_f, (void *)(n - 2));
+	/* Let one of them finish before the join. */
+	coro_yield();
+	int res = coro_join(b);
+	res += coro_join(a);
+	coro_delete(a);
+	coro_delete(b);
+	return res;
+}
+
+static int
+coro_joiner_f(void *arg)
+{
+	return coro_join(arg);
+}
+
+static int
+coro_empty_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+static int
+coro_busy_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	return 7;
+}
+
+static void
+test_join_in_sched(bool is_mt)
+{
+	struct coro *fib = coro_new(coro_fib_f, (void *)12);
+	struct coro *busy = coro_new(coro_busy_f, NULL);
+	struct coro *joiner = coro_new(coro_joiner_f, busy);
+	struct coro *lone = coro_new(coro_empty_f, NULL);
+	unit_check(coro_join(fib) == 144, "fork/join");
+	unit_check(coro_join(joiner) == 7, "join from a coroutine");
+	if (! is_mt) {
+		unit_check(coro_switch_count(joiner) == 1,
+			   "no spurious switches");
+	}
+	coro_delete(fib);
+	coro_delete(joiner);
+	coro_delete(busy);
+	/* Not joined ones are returned by coro_sched_wait(). */
+	struct coro *c = coro_sched_wait();
+	unit_check(c == lone && coro_sched_wait() == NULL,
+		   "the rest is waited");
+	coro_delete(c);
+	/* Join of a finished coroutine. */
+	lone = coro_new(coro_empty_f, NULL);
+	struct coro *other = coro_new(coro_empty_f, NULL);
+	unit_check(coro_join(other) == 0 && coro_join(lone) == 0,
+		   "join after finish");
+	unit_check(coro_sched_wait() == NULL, "nothing to wait");
+	coro_delete(lone);
+	coro_delete(other);
+}
+
+static int
+coro_join_child_f(void *arg)
+{
+	struct coro_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.joinable = true;
+	struct coro *child = coro_new_ex(coro_empty_f, NULL, &opts);
+	/* Let the child finish on another worker before the join. */
+	if ((intptr_t)arg % 2 == 0)
+		coro_yield();
+	int res = coro_join(child);
+	coro_delete(child);
+	return res + 1;
+}
+
+/**
+ * Joinable coroutines are joined by other coroutines while the main
+ * thread reaps the finished ones in coro_sched_wait().
+ */
+static void
+test_join_with_reaper(void)
+{
+	enum { COUNT = 500 };
+	for (intptr_t i = 0; i < COUNT; ++i)
+		coro_new(coro_join_child_f, (void *)i);
+	int reaped = 0;
+	int sum = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		sum += coro_status(c);
+		++reaped;
+		coro_delete(c);
+	}
+	unit_check(reaped == COUNT && sum == COUNT,
+		   "joinable coroutines are not reaped");
+}
+
+static void
+test_join(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	test_join_in_sched(false);
+	test_join_with_reaper();
+	coro_sched_init_mt(4);
+	test_join_in_sched(true);
+	test_join_with_reaper();
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	test_basic();
+	test_yield();
+	test_many();
+	test_stack_pool();
+	test_stack_opts();
+	test_mt();
+	test_io();
+	test_sync();
+	test_preempt();
+	test_gen();
+	test_telemetry();
+	test_policy();
+	test_schedulers();
+	test_shared_stack();
+	test_join();
+
+	unit_test_finish();
+	return 0;
+}
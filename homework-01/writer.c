@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "writer.h"
+
+// The longest number with its separator: " -2147483648".
+#define WRITER_MAX_NUMBER_SIZE 12
+
+static const char digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+static const uint32_t powers_of_10[] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+  1000000000,
+};
+
+/**
+ * Number of the decimal digits of the value, without a loop:
+ * log10(x) is about log2(x) * 1233 / 4096, and one comparison
+ * corrects it.
+ */
+static size_t count_digits(uint32_t value) {
+  // 0 and 1 have the same length, and so have the others.
+  value |= 1;
+  int bits = 32 - __builtin_clz(value);
+  int log10 = (bits * 1233) >> 12;
+  return log10 + 1 - (value < powers_of_10[log10]);
+}
+
+/**
+ * Formats the value at out backwards from its end, two digits per
+ * step.
+ */
+static size_t format_uint(char *out, uint32_t value) {
+  size_t length = count_digits(value);
+  char *pos = out + length;
+  while (value >= 100) {
+    uint32_t pair = value % 100;
+    value /= 100;
+    pos -= 2;
+    memcpy(pos, digit_pairs + 2 * pair, 2);
+  }
+  if (value >= 10) {
+    memcpy(pos - 2, digit_pairs + 2 * value, 2);
+  } else {
+    pos[-1] = (char)('0' + value);
+  }
+  return length;
+}
+
+size_t format_int_size(int value) {
+  if (value < 0) {
+    return 1 + count_digits(0 - (uint32_t)value);
+  }
+  return count_digits((uint32_t)value);
+}
+
+size_t format_int(char *out, int value) {
+  if (value < 0) {
+    *out = '-';
+    return 1 + format_uint(out + 1, 0 - (uint32_t)value);
+  }
+  return format_uint(out, (uint32_t)value);
+}
+
+static void number_writer_flush(struct number_writer *writer) {
+  const char *pos = writer->buffer;
+  size_t left = writer->size;
+  while (left > 0 && !writer->is_failed) {
+    ssize_t rc = writer->offset < 0 ? writer->write(writer->fd, pos, left) :
+      pwrite(writer->fd, pos, left, writer->offset);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      writer->is_failed = true;
+      break;
+    }
+    pos += rc;
+    left -= rc;
+    if (writer->offset >= 0) {
+      writer->offset += rc;
+    }
+  }
+  writer->size = 0;
+}
+
+int number_writer_open(
+  struct number_writer *writer,
+  const char *filename,
+  size_t buffer_size
+) {
+  writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer->fd < 0) {
+    return -1;
+  }
+  writer->capacity = buffer_size;
+  writer->buffer = malloc(writer->capacity);
+  writer->size = 0;
+  writer->is_first = true;
+  writer->is_failed = false;
+  writer->offset = -1;
+  writer->write = write;
+  return 0;
+}
+
+void number_writer_open_at(
+  struct number_writer *writer,
+  int fd,
+  off_t offset,
+  bool is_first,
+  size_t buffer_size
+) {
+  writer->fd = fd;
+  writer->capacity = buffer_size;
+  writer->buffer = malloc(writer->capacity);
+  writer->size = 0;
+  writer->is_first = is_first;
+  writer->is_failed = false;
+  writer->offset = offset;
+  writer->write = write;
+}
+
+void number_writer_write(
+  struct number_writer *writer,
+  const int *numbers,
+  size_t count
+) {
+  for (size_t i = 0; i < count; ++i) {
+    if (writer->capacity - writer->size < WRITER_MAX_NUMBER_SIZE) {
+      number_writer_flush(writer);
+    }
+    char *pos = writer->buffer + writer->size;
+    if (!writer->is_first) {
+      *pos++ = ' ';
+    }
+    writer->is_first = false;
+    pos += format_int(pos, numbers[i]);
+    writer->size = pos - writer->buffer;
+  }
+}
+
+int number_writer_close(struct number_writer *writer) {
+  number_writer_flush(writer);
+  free(writer->buffer);
+  if (writer->offset < 0 && close(writer->fd) != 0) {
+    writer->is_failed = true;
+  }
+  return writer->is_failed ? -1 : 0;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define NUMBER_WRITER_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * Buffered writer of numbers as text, separated by spaces. The
+ * numbers are formatted right into the buffer, which is flushed to
+ * the file with write() when full.
+ */
+struct number_writer {
+  int fd;
+  char *buffer;
+  size_t size;
+  size_t capacity;
+
+  /**
+   * True, until the first number is written. It has no separator.
+   */
+  bool is_first;
+
+  /**
+   * True, if a write has failed. The rest is not written.
+   */
+  bool is_failed;
+
+  /**
+   * Writes the buffer to the file, write() by default. A coroutine
+   * can use coro_write() instead, so the others run meanwhile.
+   */
+  ssize_t (*write)(int fd, const void *data, size_t size);
+
+  /**
+   * Where the next flush goes with pwrite(), if the writer fills a
+   * part of a file, which it does not own. -1 for write() to the
+   * end of its own file.
+   */
+  off_t offset;
+};
+
+/**
+ * Creates the file or truncates it. Returns -1 on error. The buffer
+ * size is at least 16 bytes.
+ */
+int number_writer_open(
+  struct number_writer *writer,
+  const char *filename,
+  size_t buffer_size
+);
+
+/**
+ * Starts writing into the open file from the offset, so several
+ * writers can fill disjoint parts of one file in parallel. is_first
+ * is true, if the part starts the file, then the first number has
+ * no separator. The file is not closed by the writer.
+ */
+void number_writer_open_at(
+  struct number_writer *writer,
+  int fd,
+  off_t offset,
+  bool is_first,
+  size_t buffer_size
+);
+
+void number_writer_write(
+  struct number_writer *writer,
+  const int *numbers,
+  size_t count
+);
+
+/**
+ * Flushes the buffer and closes the file, unless it is written
+ * at an offset. Returns -1, if anything has failed to be written.
+ */
+int number_writer_close(struct number_writer *writer);
+
+/**
+ * Formats the number in decimal at out, which must have room for
+ * 11 characters. Returns the length.
+ */
+size_t format_int(char *out, int value);
+
+/**
+ * Length of the number formatted by format_int().
+ */
+size_t format_int_size(int value);